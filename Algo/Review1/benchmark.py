@@ -0,0 +1,220 @@
+#!/usr/bin/env python3
+"""Compares the Aho-Corasick solutions of this directory on synthetic
+workloads.
+
+Wildcard matchers (interface.cpp, ideone_WhZ8P4.cpp, ideone_yYDo30.cpp)
+read a pattern and a text from stdin. Dictionary solutions of problem B
+(prog.cpp, "interface (1).cpp", paulin.cpp) read B.in and write B.out in
+the working directory.
+
+For the wildcard matchers, build time is the time of a run on a trivial
+input of the same workload, and the rest is attributed to scanning.
+Problem B programs count strings with a DP over the automaton and scan
+no text, so only their whole run time is reported, as seconds per run;
+their build time is not visible from outside the process. Peak RSS is
+taken from the rusage of the child process and cannot go below the few
+MiB of the launcher it is forked from.
+
+    python3 benchmark.py [--repeats N] [--only ENGINE ...]
+"""
+
+import argparse
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+COMPILER = ['g++', '-std=c++11', '-O2', '-pthread']
+
+WILDCARD_ENGINES = ['interface.cpp', 'ideone_WhZ8P4.cpp', 'ideone_yYDo30.cpp']
+DICTIONARY_ENGINES = ['prog.cpp', 'interface (1).cpp', 'paulin.cpp']
+
+WILDCARD = '?'
+
+# alphabet, pattern length, wildcard density, match density, text length
+WILDCARD_WORKLOADS = [
+    (2, 8, 0.25, 0.01, 1 << 22),
+    (4, 64, 0.25, 0.001, 1 << 22),
+    (26, 64, 0.1, 0.0001, 1 << 22),
+    (4, 1000, 0.05, 0.0001, 1 << 22),
+    (4, 1000, 0.5, 0.0001, 1 << 21),
+    (26, 10000, 0.5, 0.00001, 1 << 21),
+]
+
+# alphabet, pattern count, pattern length, string length
+DICTIONARY_WORKLOADS = [
+    (2, 10, 10, 1000),
+    (26, 10, 100, 1000),
+    (26, 100, 100, 1000),
+    (4, 1000, 10, 1000),
+]
+
+
+def compile_engines(engines, build_directory):
+    binaries = {}
+    for engine in engines:
+        binary = os.path.join(build_directory,
+                              engine.replace(' ', '_').replace('.cpp', ''))
+        subprocess.check_call(COMPILER + ['-o', binary,
+                                          os.path.join(HERE, engine)])
+        binaries[engine] = binary
+    return binaries
+
+
+# Peak RSS of a child includes the RSS its parent had when it was forked,
+# so engines are started by a minimal interpreter, which reports
+# their status and peak RSS as the last line of stderr
+LAUNCHER = """
+import os, sys
+pid = os.fork()
+if pid == 0:
+    os.execv(sys.argv[1], sys.argv[1:])
+_, status, usage = os.wait4(pid, 0)
+sys.stderr.write('\\n%d %d\\n' % (status, usage.ru_maxrss))
+"""
+
+
+def measure(binary, stdin_data, working_directory, repeats):
+    """Best wall time of several runs and the peak RSS among them."""
+    best_seconds = float('inf')
+    peak_rss = 0
+    output = b''
+    for _ in range(repeats):
+        start = time.perf_counter()
+        process = subprocess.run(
+            [sys.executable, '-S', '-c', LAUNCHER, binary], input=stdin_data,
+            stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+            cwd=working_directory)
+        best_seconds = min(best_seconds, time.perf_counter() - start)
+        output = process.stdout
+        status, rss = map(int, process.stderr.split(b'\n')[-2].split())
+        if status != 0:
+            raise RuntimeError('%s failed with status %d' % (binary, status))
+        peak_rss = max(peak_rss, rss)
+    return best_seconds, peak_rss, output
+
+
+def random_string(length, alphabet):
+    letters = [chr(ord('a') + index) for index in range(alphabet)]
+    return ''.join(random.choice(letters) for _ in range(length))
+
+
+def wildcard_input(alphabet, pattern_length, wildcard_density,
+                   match_density, text_length):
+    """Plants instances of the pattern at about match_density of the
+    positions of a random text."""
+    pattern = ''.join(WILDCARD if random.random() < wildcard_density
+                      else random_string(1, alphabet)
+                      for _ in range(pattern_length))
+    text = list(random_string(text_length, alphabet))
+    number_of_plants = int(match_density * text_length)
+    for _ in range(number_of_plants):
+        start = random.randrange(0, text_length - pattern_length + 1)
+        for offset, symbol in enumerate(pattern):
+            if symbol != WILDCARD:
+                text[start + offset] = symbol
+    return pattern, ''.join(text)
+
+
+def benchmark_wildcard(binaries, repeats, report):
+    for workload in WILDCARD_WORKLOADS:
+        alphabet, pattern_length, wildcard_density, match_density, \
+            text_length = workload
+        pattern, text = wildcard_input(*workload)
+        trivial_input = (pattern + '\n' + text[:pattern_length] + '\n').encode()
+        full_input = (pattern + '\n' + text + '\n').encode()
+        name = 'wildcard:a=%d,m=%d,w=%g,d=%g,n=%d' % workload
+        reference = None
+        for engine, binary in binaries.items():
+            build_seconds, _, _ = measure(binary, trivial_input, HERE, repeats)
+            seconds, peak_rss, output = measure(binary, full_input, HERE,
+                                                repeats)
+            matches = int(output.split()[0])
+            if reference is None:
+                reference = output
+            elif output != reference:
+                print('warning: %s disagrees on %s' % (engine, name),
+                      file=sys.stderr)
+            scan_seconds = max(seconds - build_seconds, 1e-9)
+            report(engine, name, build_seconds, text_length / scan_seconds,
+                   scan_seconds * 1e9 / matches if matches else None,
+                   seconds, peak_rss)
+
+
+def benchmark_dictionary(binaries, repeats, report):
+    for workload in DICTIONARY_WORKLOADS:
+        alphabet, pattern_count, pattern_length, string_length = workload
+        patterns = [random_string(pattern_length, alphabet)
+                    for _ in range(pattern_count)]
+        name = 'dictionary:a=%d,k=%d,m=%d,n=%d' % workload
+        reference = None
+        for engine, binary in binaries.items():
+            # Problem B programs use fixed file names,
+            # so each one runs in a directory of its own
+            working_directory = tempfile.mkdtemp()
+            try:
+                with open(os.path.join(working_directory, 'B.in'),
+                          'w') as input_file:
+                    input_file.write('%d %d %d\n' % (
+                        string_length, pattern_count, alphabet))
+                    input_file.write('\n'.join(patterns) + '\n')
+                seconds, peak_rss, _ = measure(binary, b'', working_directory,
+                                               repeats)
+                with open(os.path.join(working_directory, 'B.out')) as output:
+                    answer = output.read().strip()
+            finally:
+                shutil.rmtree(working_directory)
+            if reference is None:
+                reference = answer
+            elif answer != reference:
+                print('warning: %s disagrees on %s' % (engine, name),
+                      file=sys.stderr)
+            report(engine, name, None, None, None, seconds, peak_rss)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[0])
+    parser.add_argument('--repeats', type=int, default=3)
+    parser.add_argument('--seed', type=int, default=2016)
+    parser.add_argument('--only', nargs='+', metavar='ENGINE',
+                        help='engines to run, e.g. interface.cpp')
+    arguments = parser.parse_args()
+    random.seed(arguments.seed)
+
+    def selected(engines):
+        return [engine for engine in engines
+                if not arguments.only or engine in arguments.only]
+
+    # Columns which do not apply to a workload are printed as '-'
+    def report(engine, workload, build_seconds, bytes_per_second,
+               ns_per_match, seconds_per_run, peak_rss):
+        def column(value, format_string):
+            return '-' if value is None else format_string % value
+
+        print('%-20s %-44s %10s %12s %12s %10.4f %10d' % (
+            engine, workload, column(build_seconds, '%.4f'),
+            column(bytes_per_second, '%.3e'), column(ns_per_match, '%.1f'),
+            seconds_per_run, peak_rss))
+        sys.stdout.flush()
+
+    build_directory = tempfile.mkdtemp()
+    try:
+        wildcard_binaries = compile_engines(selected(WILDCARD_ENGINES),
+                                            build_directory)
+        dictionary_binaries = compile_engines(selected(DICTIONARY_ENGINES),
+                                              build_directory)
+        print('%-20s %-44s %10s %12s %12s %10s %10s' % (
+            'engine', 'workload', 'build_s', 'bytes/s', 'ns/match',
+            's/run', 'rss_kib'))
+        benchmark_wildcard(wildcard_binaries, arguments.repeats, report)
+        benchmark_dictionary(dictionary_binaries, arguments.repeats, report)
+    finally:
+        shutil.rmtree(build_directory)
+
+
+if __name__ == '__main__':
+    main()
@@ -1,16 +1,42 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cctype>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
 #include <deque>
+#include <fstream>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <queue>
+#include <random>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <system_error>
+#include <thread>
+#include <tuple>
 #include <unordered_set>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 //  std::make_unique will be available since c++14
 //  Implementation was taken from http://herbsutter.com/gotw/_102/
 template <typename T, typename... Args>
@@ -21,6 +47,7 @@ std::unique_ptr<T> make_unique(Args &&... args) {
 template <class Iterator>
 class IteratorRange {
  public:
+  IteratorRange() : begin_(), end_() {}
   IteratorRange(Iterator begin, Iterator end) : begin_(begin), end_(end) {}
 
   Iterator begin() const { return begin_; }
@@ -30,18 +57,207 @@ class IteratorRange {
   Iterator begin_, end_;
 };
 
+size_t DefaultNumberOfThreads() {
+  return std::max<size_t>(1, std::thread::hardware_concurrency());
+}
+
+// Runs task(index) for every index in [0, number_of_tasks),
+// each one in its own thread
+template <class Task>
+void RunInParallel(size_t number_of_tasks, Task task) {
+  std::vector<std::thread> threads;
+  threads.reserve(number_of_tasks);
+  for (size_t index = 0; index < number_of_tasks; ++index) {
+    threads.emplace_back(task, index);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+// Runs body(index) for every index in [begin, end), splitting the range
+// into contiguous parts for at most number_of_threads threads
+template <class Body>
+void ParallelFor(size_t begin, size_t end, size_t number_of_threads,
+                 Body body) {
+  // Smaller parts are not worth starting a thread
+  constexpr size_t kMinPartLength = 1 << 12;
+
+  const size_t length = end - begin;
+  const size_t number_of_parts = std::max<size_t>(
+      1, std::min(number_of_threads, length / kMinPartLength));
+  if (number_of_parts == 1) {
+    for (size_t index = begin; index < end; ++index) {
+      body(index);
+    }
+    return;
+  }
+  const size_t part_length = (length + number_of_parts - 1) / number_of_parts;
+  RunInParallel(number_of_parts, [&](size_t part) {
+    const size_t part_begin = std::min(end, begin + part * part_length);
+    const size_t part_end = std::min(end, part_begin + part_length);
+    for (size_t index = part_begin; index < part_end; ++index) {
+      body(index);
+    }
+  });
+}
+
+namespace stats {
+
+// Events on the hot paths of the automata and the matchers. They are
+// counted only when compiled with -DAHO_CORASICK_STATS, otherwise
+// COUNT_EVENT expands to nothing. Every thread counts into its own copy,
+// which is added to the totals when the thread exits. Events of building
+// an automaton have counters of their own, so the scan counters show
+// only the work done on the text
+struct Counters {
+  Counters()
+      : build_cache_fills(0), build_suffix_link_hops(0), transitions(0),
+        suffix_link_hops(0), reported_ids(0), counter_increments(0),
+        prefilter_restarts(0) {}
+
+  void Add(const Counters &other) {
+    build_cache_fills += other.build_cache_fills;
+    build_suffix_link_hops += other.build_suffix_link_hops;
+    transitions += other.transitions;
+    suffix_link_hops += other.suffix_link_hops;
+    reported_ids += other.reported_ids;
+    counter_increments += other.counter_increments;
+    prefilter_restarts += other.prefilter_restarts;
+  }
+
+  // Transitions memoized by GetAutomatonTransition
+  uint64_t build_cache_fills;
+  // Suffix links followed while computing the links of new states
+  uint64_t build_suffix_link_hops;
+  uint64_t transitions;
+  uint64_t suffix_link_hops;
+  // Ids of found words passed to GenerateMatches callbacks
+  uint64_t reported_ids;
+  // Increments of the per-position word counters of the matchers
+  uint64_t counter_increments;
+  // Restarts of WildcardMatcher after characters skipped by the prefilter
+  uint64_t prefilter_restarts;
+};
+
+#ifdef AHO_CORASICK_STATS
+
+inline Counters &Totals() {
+  static Counters totals;
+  return totals;
+}
+
+inline std::mutex &TotalsMutex() {
+  static std::mutex totals_mutex;
+  return totals_mutex;
+}
+
+struct ThreadCounters {
+  ~ThreadCounters() {
+    std::lock_guard<std::mutex> lock(TotalsMutex());
+    Totals().Add(counters);
+  }
+
+  Counters counters;
+};
+
+inline Counters &ThreadLocal() {
+  thread_local ThreadCounters thread_counters;
+  return thread_counters.counters;
+}
+
+// Counters of the threads still running are not included
+inline void Dump(std::ostream &output_stream) {
+  std::lock_guard<std::mutex> lock(TotalsMutex());
+  const Counters &totals = Totals();
+  output_stream << "stats: build_cache_fills " << totals.build_cache_fills
+                << "\n"
+                << "stats: build_suffix_link_hops "
+                << totals.build_suffix_link_hops << "\n"
+                << "stats: transitions " << totals.transitions << "\n"
+                << "stats: suffix_link_hops " << totals.suffix_link_hops
+                << "\n"
+                << "stats: reported_ids " << totals.reported_ids << "\n"
+                << "stats: counter_increments " << totals.counter_increments
+                << "\n"
+                << "stats: prefilter_restarts " << totals.prefilter_restarts
+                << std::endl;
+}
+
+#define COUNT_EVENT(counter) (++::stats::ThreadLocal().counter)
+
+#else
+
+#define COUNT_EVENT(counter) static_cast<void>(0)
+
+#endif  // AHO_CORASICK_STATS
+
+}  // namespace stats
+
+// Read-only view of a whole file. Pages are loaded on demand and are
+// shared through the page cache by all the processes mapping the file
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string &path) : data_(nullptr), size_(0) {
+    const int descriptor = open(path.c_str(), O_RDONLY);
+    if (descriptor < 0) {
+      throw std::system_error(errno, std::generic_category(), path);
+    }
+    struct stat status;
+    if (fstat(descriptor, &status) != 0) {
+      const int error = errno;
+      close(descriptor);
+      throw std::system_error(error, std::generic_category(), path);
+    }
+    size_ = static_cast<size_t>(status.st_size);
+    if (size_ > 0) {
+      void *data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, descriptor, 0);
+      if (data == MAP_FAILED) {
+        const int error = errno;
+        close(descriptor);
+        throw std::system_error(error, std::generic_category(), path);
+      }
+      data_ = static_cast<const char *>(data);
+    }
+    close(descriptor);
+  }
+
+  ~MappedFile() {
+    if (data_ != nullptr) {
+      munmap(const_cast<char *>(data_), size_);
+    }
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *Data() const { return data_; }
+  size_t Size() const { return size_; }
+
+  // Lets the kernel read ahead and drop pages behind a sequential scan
+  void AdviseSequential() const {
+    if (data_ != nullptr) {
+      madvise(const_cast<char *>(data_), size_, MADV_SEQUENTIAL);
+    }
+  }
+
+ private:
+  const char *data_;
+  size_t size_;
+};
+
 namespace traverses {
 
 template <class Vertex, class Graph, class Visitor>
 void BreadthFirstSearch(Vertex origin_vertex, const Graph &graph,
-                        Visitor visitor) {
+                        Visitor &visitor) {
   std::queue<Vertex> vertex_queue;
   vertex_queue.push(origin_vertex);
   while (!vertex_queue.empty()) {
     const Vertex vertex = vertex_queue.front();
     vertex_queue.pop();
     visitor.ExamineVertex(vertex);
-    for (const auto& edge : OutgoingEdges(graph, vertex)) {
+    for (const auto edge : OutgoingEdges(graph, vertex)) {
       visitor.ExamineEdge(edge);
       visitor.DiscoverVertex(GetTarget(graph, edge));
       vertex_queue.push(GetTarget(graph, edge));
@@ -51,13 +267,15 @@ void BreadthFirstSearch(Vertex origin_vertex, const Graph &graph,
 
 // See "Visitor Event Points" on
 // http://www.boost.org/doc/libs/1_57_0/libs/graph/doc/breadth_first_search.html
+// BreadthFirstSearch is instantiated for the derived visitor, so its hooks
+// hide these no-op defaults at compile time and are called without
+// virtual dispatch
 template <class Vertex, class Edge>
 class BfsVisitor {
  public:
-  virtual void DiscoverVertex(Vertex /*vertex*/) {}
-  virtual void ExamineEdge(const Edge & /*edge*/) {}
-  virtual void ExamineVertex(Vertex /*vertex*/) {}
-  virtual ~BfsVisitor() = default;
+  void DiscoverVertex(Vertex /*vertex*/) {}
+  void ExamineEdge(const Edge & /*edge*/) {}
+  void ExamineVertex(Vertex /*vertex*/) {}
 };
 
 }  // namespace traverses
@@ -65,9 +283,10 @@ class BfsVisitor {
 namespace aho_corasick {
 
 struct AutomatonNode {
-  AutomatonNode() : suffix_link(nullptr), terminal_link(nullptr) {}
+  AutomatonNode() : suffix_link(nullptr) {}
 
-  // Stores ids of strings which are ended at this node
+  // Stores ids of strings which are ended at this node and, once the
+  // automaton is built, at all the nodes reachable by suffix links
   std::vector<size_t> terminated_string_ids;
   // Stores tree structure of nodes
   std::map<char, AutomatonNode> trie_transitions;
@@ -75,7 +294,6 @@ struct AutomatonNode {
   // Stores pointers to the elements of trie_transitions
   std::map<char, AutomatonNode *> automaton_transitions_cache;
   AutomatonNode *suffix_link;
-  AutomatonNode *terminal_link;
 };
 
 AutomatonNode *GetTrieTransition(AutomatonNode *node, char character) {
@@ -93,10 +311,14 @@ AutomatonNode *GetAutomatonTransition(AutomatonNode *node, AutomatonNode *root,
     return result;
   } 
 
+  COUNT_EVENT(build_cache_fills);
   const auto direct_transition = GetTrieTransition(node, character);
   if (direct_transition != nullptr) {
     result = direct_transition;
   } else {
+    if (node != root) {
+      COUNT_EVENT(build_suffix_link_hops);
+    }
     result = (node != root) ?
         GetAutomatonTransition(node->suffix_link, root, character) :
         root;
@@ -104,6 +326,18 @@ AutomatonNode *GetAutomatonTransition(AutomatonNode *node, AutomatonNode *root,
   return result;
 }
 
+// Relies on transitions completed by AutomatonBuilder: characters which are
+// absent from the cache never occur in the words and always lead to the root.
+// Never modifies the automaton, so it is safe to call from several threads
+const AutomatonNode *GetCompletedTransition(const AutomatonNode *node,
+                                            const AutomatonNode *root,
+                                            char character) {
+  const auto transition = node->automaton_transitions_cache.find(character);
+  return (transition != node->automaton_transitions_cache.end()) ?
+          transition->second :
+          root;
+}
+
 namespace internal {
 
 class AutomatonGraph {
@@ -116,15 +350,39 @@ class AutomatonGraph {
     AutomatonNode *target;
     char character;
   };
+
+  // Makes the edges of a node from its trie transitions on the fly
+  class EdgeIterator {
+   public:
+    typedef std::map<char, AutomatonNode>::iterator TransitionIterator;
+
+    EdgeIterator(AutomatonNode *source, TransitionIterator transition)
+        : source_(source), transition_(transition) {}
+
+    Edge operator*() const {
+      return Edge(source_, &transition_->second, transition_->first);
+    }
+
+    EdgeIterator &operator++() {
+      ++transition_;
+      return *this;
+    }
+
+    bool operator!=(const EdgeIterator &other) const {
+      return transition_ != other.transition_;
+    }
+
+   private:
+    AutomatonNode *source_;
+    TransitionIterator transition_;
+  };
 };
 
-std::vector<typename AutomatonGraph::Edge> OutgoingEdges(
+IteratorRange<AutomatonGraph::EdgeIterator> OutgoingEdges(
     const AutomatonGraph & /*graph*/, AutomatonNode *vertex) {
-  std::vector<typename AutomatonGraph::Edge> out_edges;
-  for (auto &transition : vertex->trie_transitions) {
-    out_edges.emplace_back(vertex, &transition.second, transition.first);
-  }
-  return out_edges;
+  typedef AutomatonGraph::EdgeIterator EdgeIterator;
+  return {EdgeIterator(vertex, vertex->trie_transitions.begin()),
+          EdgeIterator(vertex, vertex->trie_transitions.end())};
 }
 
 AutomatonNode *GetTarget(const AutomatonGraph & /*graph*/,
@@ -132,45 +390,46 @@ AutomatonNode *GetTarget(const AutomatonGraph & /*graph*/,
   return edge.target;
 }
 
-class SuffixLinkCalculator
+// Computes suffix links, flattened terminated strings and
+// completed transitions of all the nodes in a single sweep. Everything
+// a node needs is taken from its parent and its suffix link, which are
+// both shallower and so have already been examined
+class LinkCalculator
   : public traverses::BfsVisitor<AutomatonNode *, AutomatonGraph::Edge> {
 public:
-  explicit SuffixLinkCalculator(AutomatonNode *root) : root_(root) {}
+  LinkCalculator(AutomatonNode *root, const std::string &alphabet)
+      : root_(root), alphabet_(alphabet) {}
 
-  void ExamineVertex(AutomatonNode *node) override {
+  // Transitions of the suffix link are complete,
+  // so every transition is resolved in constant time
+  void ExamineVertex(AutomatonNode *node) {
     if (node->suffix_link == nullptr) {
       node->suffix_link = root_;
     }
-  }
-
-  void ExamineEdge(const AutomatonGraph::Edge &edge) override {
-    auto& current_node = edge.target->suffix_link = edge.source->suffix_link;
-    if (edge.source == root_) {
-      return;
+    for (const char character : alphabet_) {
+      GetAutomatonTransition(node, root_, character);
     }
-
-    current_node = GetAutomatonTransition(current_node, root_, edge.character);
   }
 
-private:
-  AutomatonNode *root_;
-};
-
-class TerminalLinkCalculator
-  : public traverses::BfsVisitor<AutomatonNode *, AutomatonGraph::Edge> {
-public:
-  explicit TerminalLinkCalculator(AutomatonNode *root) : root_(root) {}
+  void ExamineEdge(const AutomatonGraph::Edge &edge) {
+    edge.target->suffix_link = (edge.source == root_) ?
+        root_ :
+        GetAutomatonTransition(edge.source->suffix_link, root_,
+                               edge.character);
+  }
 
-  void DiscoverVertex(AutomatonNode *node) override {
-    if (node->suffix_link->terminated_string_ids.empty()) {
-      node->terminal_link = node->suffix_link->terminal_link;
-    } else {
-      node->terminal_link = node->suffix_link;
-    }
+  // Ids of the suffix link are already flattened,
+  // so they are appended without following the chain further
+  void DiscoverVertex(AutomatonNode *node) {
+    const auto &inherited_ids = node->suffix_link->terminated_string_ids;
+    node->terminated_string_ids.insert(node->terminated_string_ids.end(),
+                                       inherited_ids.begin(),
+                                       inherited_ids.end());
   }
 
 private:
   AutomatonNode *root_;
+  const std::string &alphabet_;
 };
 
 }  // namespace internal
@@ -180,21 +439,22 @@ class NodeReference {
  public:
   NodeReference() : node_(nullptr), root_(nullptr) {}
 
-  NodeReference(AutomatonNode *node, AutomatonNode *root)
+  NodeReference(const AutomatonNode *node, const AutomatonNode *root)
       : node_(node), root_(root) {}
 
   NodeReference Next(char character) const {
-    return NodeReference(GetAutomatonTransition(node_, root_, character), root_);
+    COUNT_EVENT(transitions);
+    return NodeReference(GetCompletedTransition(node_, root_, character),
+                         root_);
   }
 
+  // Terminated strings of a built automaton already include
+  // those of all the nodes reachable by terminal links
   template <class Callback>
   void GenerateMatches(Callback on_match) const {
-    auto node = *this;
-    while (node) {
-      for (auto id : node.TerminatedStringIds()) {
-        on_match(id);
-      }
-      node = node.TerminalLink();
+    for (auto id : TerminatedStringIds()) {
+      COUNT_EVENT(reported_ids);
+      on_match(id);
     }
   }
 
@@ -208,16 +468,12 @@ class NodeReference {
   typedef std::vector<size_t>::const_iterator TerminatedStringIterator;
   typedef IteratorRange<TerminatedStringIterator> TerminatedStringIteratorRange;
 
-  NodeReference TerminalLink() const {
-    return NodeReference(node_->terminal_link, root_);
-  }
-
   TerminatedStringIteratorRange TerminatedStringIds() const {
     return {node_->terminated_string_ids.begin(), node_->terminated_string_ids.end()};
   }
 
-  AutomatonNode *node_;
-  AutomatonNode *root_;
+  const AutomatonNode *node_;
+  const AutomatonNode *root_;
 };
 
 class AutomatonBuilder;
@@ -229,7 +485,7 @@ class Automaton {
   Automaton(const Automaton &) = delete;
   Automaton &operator=(const Automaton &) = delete;
 
-  NodeReference Root() {
+  NodeReference Root() const {
     return NodeReference(&root_, &root_);
   }
 
@@ -239,201 +495,2945 @@ class Automaton {
   friend class AutomatonBuilder;
 };
 
-class AutomatonBuilder {
- public:
-  void Add(const std::string &string, size_t id) {
-    words_.push_back(string);
-    ids_.push_back(id);
+// Compiled automata refer to their states by 32-bit indices
+typedef uint32_t StateIndex;
+
+const StateIndex kNoState = std::numeric_limits<StateIndex>::max();
+const size_t kAlphabetSize = 1 << CHAR_BIT;
+
+// Characters of a word kept in memory the builder does not own
+typedef IteratorRange<const char *> WordView;
+
+inline size_t Length(WordView word) {
+  return static_cast<size_t>(word.end() - word.begin());
+}
+
+// Bytes are compared as unsigned, as std::string does
+inline bool LexicographicallyLess(WordView lhs, WordView rhs) {
+  const int order = std::memcmp(lhs.begin(), rhs.begin(),
+                                std::min(Length(lhs), Length(rhs)));
+  return order < 0 || (order == 0 && Length(lhs) < Length(rhs));
+}
+
+namespace internal {
+
+// Ids of strings which are ended at state i are stored in ids
+// between offsets[i] and offsets[i + 1]. Once the automaton is built,
+// the slice of a state also holds the ids of all the states reachable
+// by terminal links, so that matches are reported by a linear read
+struct TerminatedStringTable {
+  IteratorRange<const size_t *> Ids(StateIndex state) const {
+    return {ids.data() + offsets[state], ids.data() + offsets[state + 1]};
   }
 
-  std::unique_ptr<Automaton> Build() {
-    auto automaton = make_unique<Automaton>();
-    BuildTrie(words_, ids_, automaton.get());
-    BuildSuffixLinks(automaton.get());
-    BuildTerminalLinks(automaton.get());
-    return automaton;
+  bool Empty(StateIndex state) const {
+    return offsets[state] == offsets[state + 1];
   }
 
- private:
-  static void BuildTrie(const std::vector<std::string> &words,
-                        const std::vector<size_t> &ids, Automaton *automaton) {
-    for (size_t i = 0; i < words.size(); ++i) {
-      AddString(&automaton->root_, ids[i], words[i]);
-    }
+  size_t SizeInBytes() const {
+    return (offsets.size() + ids.size()) * sizeof(size_t);
   }
 
-  static void AddString(AutomatonNode *root, size_t string_id,
-                        const std::string &string) {
-    auto current_node = root;
-    for (const char symbol : string) {
-      current_node = &(current_node->trie_transitions[symbol]);
+  std::vector<size_t> offsets;
+  std::vector<size_t> ids;
+};
+
+// Finds the first free cell at or after a given one. Occupied cells
+// point further along the array, and the pointers are shortened
+// on every search
+class FreeCells {
+ public:
+  size_t Find(size_t cell) {
+    size_t free_cell = cell;
+    while (free_cell < next_.size() && next_[free_cell] != free_cell) {
+      free_cell = next_[free_cell];
     }
-    current_node->terminated_string_ids.push_back(string_id);
+    while (cell < next_.size() && next_[cell] != cell) {
+      const size_t next = next_[cell];
+      next_[cell] = free_cell;
+      cell = next;
+    }
+    return free_cell;
   }
 
-  static void BuildSuffixLinks(Automaton *automaton) {
-    internal::SuffixLinkCalculator suffix_link_calculator(&automaton->root_);
-    traverses::BreadthFirstSearch(
-        &automaton->root_,
-        internal::AutomatonGraph(),
-        suffix_link_calculator);
+  void Occupy(size_t cell) {
+    while (next_.size() <= cell + 1) {
+      next_.push_back(next_.size());
+    }
+    next_[cell] = cell + 1;
   }
 
-  static void BuildTerminalLinks(Automaton *automaton) {
-    internal::TerminalLinkCalculator terminal_link_calculator(&automaton->root_);
-    traverses::BreadthFirstSearch(
-        &automaton->root_,
-        internal::AutomatonGraph(),
-        terminal_link_calculator);
+  // Returns the least base such that all the cells base + code are free
+  size_t FindBase(const std::vector<size_t> &codes) {
+    const size_t least_code = *std::min_element(codes.begin(), codes.end());
+    for (size_t cell = Find(least_code);; cell = Find(cell + 1)) {
+      const size_t base = cell - least_code;
+      const bool fits = std::all_of(
+          codes.begin(), codes.end(), [this, base](size_t code) {
+            return Find(base + code) == base + code;
+          });
+      if (fits) {
+        return base;
+      }
+    }
   }
 
-  std::vector<std::string> words_;
-  std::vector<size_t> ids_;
+ private:
+  std::vector<size_t> next_;
 };
 
-}  // namespace aho_corasick
+}  // namespace internal
 
-// Consecutive delimiters are not grouped together and are deemed
-// to delimit empty strings
-template <class Predicate>
-std::vector<std::string> Split(const std::string &string,
-                               Predicate is_delimiter) {
-  std::vector<std::string> substrings;
-  std::string current_string = "";
-  for (const char symbol : string) {
-    if (is_delimiter(symbol)) {
-      substrings.push_back(std::move(current_string));
-      current_string.clear();
-    } else {
-      current_string.push_back(symbol);
+// Cursor over any of the compiled automata
+template <class CompiledAutomaton>
+class CompiledNodeReference {
+ public:
+  CompiledNodeReference() : automaton_(nullptr), state_(kNoState) {}
+
+  CompiledNodeReference(const CompiledAutomaton *automaton, StateIndex state)
+      : automaton_(automaton), state_(state) {}
+
+  CompiledNodeReference Next(char character) const {
+    COUNT_EVENT(transitions);
+    return CompiledNodeReference(automaton_,
+                                 automaton_->Next(state_, character));
+  }
+
+  template <class Callback>
+  void GenerateMatches(Callback on_match) const {
+    for (auto id : automaton_->terminated_strings_.Ids(state_)) {
+      COUNT_EVENT(reported_ids);
+      on_match(id);
     }
   }
 
-  if (!current_string.empty()) {
-    substrings.push_back(std::move(current_string));
+  explicit operator bool() const {
+    return automaton_ != nullptr && state_ != kNoState;
   }
 
-  return substrings;
-}
+  bool operator==(CompiledNodeReference other) const {
+    return state_ == other.state_ && automaton_ == other.automaton_;
+  }
 
-// Wildcard is a character that may be substituted
-// for any of all possible characters
-class WildcardMatcher {
+ private:
+  const CompiledAutomaton *automaton_;
+  StateIndex state_;
+};
+
+// Node of ArenaAutomaton. Children of every node are stored
+// contiguously and ordered by their characters
+struct ArenaNode {
+  ArenaNode()
+      : first_child(0), suffix_link(0), terminal_link(kNoState),
+        number_of_children(0), character(0) {}
+
+  StateIndex first_child;
+  StateIndex suffix_link;
+  StateIndex terminal_link;
+  uint16_t number_of_children;
+  // Character of the trie edge leading to this node
+  char character;
+};
+
+// All nodes live in one vector in breadth-first order, so the whole trie
+// takes a handful of allocations. Transitions are not cached, which keeps
+// a built automaton immutable
+class ArenaAutomaton {
  public:
-  WildcardMatcher() : number_of_words_(0), pattern_length_(0) {}
+  ArenaAutomaton() = default;
 
-  void Init(const std::string &pattern, char wildcard) {
-    aho_corasick::AutomatonBuilder builder;
-    const std::vector<std::string> patterns = Split(
-        pattern,
-        [wildcard](char symbol) -> bool {
-          return symbol == wildcard;
-        });
+  ArenaAutomaton(const ArenaAutomaton &) = delete;
+  ArenaAutomaton &operator=(const ArenaAutomaton &) = delete;
 
-    size_t total_length = 0;
-    size_t number_of_words = 0;
-    for (const auto& pattern : patterns) {
-      total_length += pattern.length();
-      if (!pattern.empty()) {
-        builder.Add(pattern, total_length);
-        ++number_of_words;
-      }
-      ++total_length;
-    }
+  CompiledNodeReference<ArenaAutomaton> Root() const {
+    return CompiledNodeReference<ArenaAutomaton>(this, 0);
+  }
 
-    number_of_words_ = number_of_words;
-    pattern_length_ = pattern.length();
+  size_t NumberOfStates() const { return nodes_.size(); }
 
-    aho_corasick_automaton_ = std::move(builder.Build());
-    Reset();
+  size_t SizeInBytes() const {
+    return nodes_.size() * sizeof(ArenaNode) +
+           terminated_strings_.SizeInBytes();
   }
 
-  // Resets matcher to start scanning new stream
-  void Reset() {
-    words_occurrences_by_position_.clear();
-    state_ = aho_corasick_automaton_->Root();
+ private:
+  StateIndex FindChild(StateIndex state, char character) const {
+    const ArenaNode &node = nodes_[state];
+    const auto children_begin = nodes_.begin() + node.first_child;
+    const auto children_end = children_begin + node.number_of_children;
+    const auto child = std::lower_bound(
+        children_begin, children_end, character,
+        [](const ArenaNode &child, char character) {
+          return static_cast<unsigned char>(child.character) <
+                 static_cast<unsigned char>(character);
+        });
+    return (child != children_end && child->character == character) ?
+        static_cast<StateIndex>(child - nodes_.begin()) :
+        kNoState;
   }
 
-  template <class Callback>
-  void Scan(char character, Callback on_match) {
-    state_ = state_.Next(character);
+  StateIndex Next(StateIndex state, char character) const {
+    return FollowLinks<false>(state, character);
+  }
 
-    UpdateWordOccurrences();
+  // Suffix links followed by AutomatonBuilder are counted as building work
+  StateIndex NextWhileBuilding(StateIndex state, char character) const {
+    return FollowLinks<true>(state, character);
+  }
 
-    if (words_occurrences_by_position_.size() >= pattern_length_) {
-      if (words_occurrences_by_position_.front() == number_of_words_) {
-        on_match();
+  template <bool kBuilding>
+  StateIndex FollowLinks(StateIndex state, char character) const {
+    while (true) {
+      const StateIndex child = FindChild(state, character);
+      if (child != kNoState) {
+        return child;
+      }
+      if (state == 0) {
+        return 0;
+      }
+      if (kBuilding) {
+        COUNT_EVENT(build_suffix_link_hops);
+      } else {
+        COUNT_EVENT(suffix_link_hops);
       }
-      ShiftWordOccurrencesCounters();
+      state = nodes_[state].suffix_link;
     }
   }
 
- private:
-  void UpdateWordOccurrences() {
-    words_occurrences_by_position_.push_back(0);
-    state_.GenerateMatches(
-        [this](size_t id) {
-          if (words_occurrences_by_position_.size() >= id) {
-            size_t index = words_occurrences_by_position_.size() - id;
-            ++(this->words_occurrences_by_position_[index]);
-          }
-        });
+  std::vector<ArenaNode> nodes_;
+  internal::TerminatedStringTable terminated_strings_;
+
+  friend class AutomatonBuilder;
+  friend class CompiledNodeReference<ArenaAutomaton>;
+};
+
+// Transitions of every state are completed for all the bytes and stored
+// in a flat states x classes table, so that one step of scanning costs
+// two indexed loads. Bytes labelling no trie edge behave identically
+// and share a single class, so the table has at most
+// one column more than the alphabet of the patterns
+class DenseAutomaton {
+ public:
+  DenseAutomaton() : number_of_classes_(0) {}
+
+  DenseAutomaton(const DenseAutomaton &) = delete;
+  DenseAutomaton &operator=(const DenseAutomaton &) = delete;
+
+  CompiledNodeReference<DenseAutomaton> Root() const {
+    return CompiledNodeReference<DenseAutomaton>(this, 0);
   }
 
-  void ShiftWordOccurrencesCounters() {
-    words_occurrences_by_position_.pop_front();
+  size_t NumberOfStates() const {
+    return transitions_.size() / number_of_classes_;
   }
 
-  // Storing only O(|pattern|) elements allows us
-  // to consume only O(|pattern|) memory for matcher
-  std::deque<size_t> words_occurrences_by_position_;
-  aho_corasick::NodeReference state_;
-  size_t number_of_words_;
-  size_t pattern_length_;
-  std::unique_ptr<aho_corasick::Automaton> aho_corasick_automaton_;
+  size_t NumberOfClasses() const { return number_of_classes_; }
+
+  size_t SizeInBytes() const {
+    return transitions_.size() * sizeof(StateIndex) +
+           terminated_strings_.SizeInBytes();
+  }
+
+ private:
+  StateIndex Next(StateIndex state, char character) const {
+    return transitions_[state * number_of_classes_ +
+                        byte_classes_[static_cast<unsigned char>(character)]];
+  }
+
+  std::array<uint8_t, kAlphabetSize> byte_classes_;
+  size_t number_of_classes_;
+  // Row of state i occupies
+  // [i * number_of_classes_, (i + 1) * number_of_classes_)
+  std::vector<StateIndex> transitions_;
+  internal::TerminatedStringTable terminated_strings_;
+
+  friend class AutomatonBuilder;
+  friend class CompiledNodeReference<DenseAutomaton>;
 };
 
-std::string ReadString(std::istream &input_stream) {
-  std::string input_string;
-  input_stream >> input_string;
-  return input_string;
-}
+// Cell of DoubleArrayAutomaton. A state occupies the cell of the same
+// index; its child by class c is the cell base + c, provided that
+// the check of that cell holds the state
+struct DoubleArrayCell {
+  DoubleArrayCell()
+      : base(0), check(kNoState), suffix_link(0) {}
 
-// Returns positions of the first character of every match
-std::vector<size_t> FindFuzzyMatches(const std::string &pattern_with_wildcards,
-                                     const std::string &text, char wildcard) {
-  WildcardMatcher matcher;
-  matcher.Init(pattern_with_wildcards, wildcard);
-  std::vector<size_t> occurrences;
-  for (size_t offset = 0; offset < text.size(); ++offset) {
-    matcher.Scan(
-        text[offset],
-        [&occurrences, offset, &pattern_with_wildcards] {
-          occurrences.push_back(offset + 1 - pattern_with_wildcards.size());
-        });
+  StateIndex base;
+  StateIndex check;
+  StateIndex suffix_link;
+};
+
+namespace internal {
+
+inline StateIndex NextInDoubleArray(const DoubleArrayCell *cells,
+                                    const uint8_t *byte_classes,
+                                    StateIndex state, char character) {
+  const StateIndex code = byte_classes[static_cast<unsigned char>(character)];
+  while (true) {
+    const StateIndex child = cells[state].base + code;
+    if (cells[child].check == state) {
+      return child;
+    }
+    if (state == 0) {
+      return 0;
+    }
+    COUNT_EVENT(suffix_link_hops);
+    state = cells[state].suffix_link;
   }
-  return occurrences;
 }
 
+}  // namespace internal
+
+// Children of all states are interleaved in one array of cells, so
+// a transition is found with a single lookup, while the array stays
+// nearly as small as the trie itself. Missing transitions are resolved
+// through suffix links, as in ArenaAutomaton
+class DoubleArrayAutomaton {
+ public:
+  DoubleArrayAutomaton() : number_of_classes_(0), max_string_length_(0) {}
 
-void Print(const std::vector<size_t> &sequence) {
-  std::cout << sequence.size() << std::endl;
+  DoubleArrayAutomaton(const DoubleArrayAutomaton &) = delete;
+  DoubleArrayAutomaton &operator=(const DoubleArrayAutomaton &) = delete;
 
-  for (const auto element : sequence) {
-    std::cout << element << " ";
+  CompiledNodeReference<DoubleArrayAutomaton> Root() const {
+    return CompiledNodeReference<DoubleArrayAutomaton>(this, 0);
   }
-  
-  std::cout << std::endl;
-}
 
+  // Unused cells are counted as well
+  size_t NumberOfCells() const { return cells_.size(); }
 
+  // Matches never span more characters than this
+  size_t MaxStringLength() const { return max_string_length_; }
 
-int main(int argc, char *argv[]) {
+  size_t SizeInBytes() const {
+    return cells_.size() * sizeof(DoubleArrayCell) +
+           terminated_strings_.SizeInBytes();
+  }
 
-  constexpr char kWildcard = '?';
-  const std::string pattern_with_wildcards = ReadString(std::cin);
-  const std::string text = ReadString(std::cin);
-  Print(FindFuzzyMatches(pattern_with_wildcards, text, kWildcard));
+  // Writes the image read by AutomatonImage
+  void Serialize(std::ostream &output_stream) const;
+
+ private:
+  StateIndex Next(StateIndex state, char character) const {
+    return internal::NextInDoubleArray(cells_.data(), byte_classes_.data(),
+                                       state, character);
+  }
+
+  std::array<uint8_t, kAlphabetSize> byte_classes_;
+  size_t number_of_classes_;
+  size_t max_string_length_;
+  // Padded with number_of_classes_ unused cells,
+  // so that base + class never leaves the array
+  std::vector<DoubleArrayCell> cells_;
+  internal::TerminatedStringTable terminated_strings_;
+
+  friend class AutomatonBuilder;
+  friend class CompiledNodeReference<DoubleArrayAutomaton>;
+};
+
+namespace internal {
+
+// Image of DoubleArrayAutomaton is laid out as
+// header, byte classes, cells, string offsets and string ids.
+// Cells are padded so that every part starts at an offset aligned
+// for its elements,
+// and all the references inside are indices, so the image
+// may be mapped at any address
+struct ImageHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t number_of_classes;
+  uint64_t number_of_cells;
+  uint64_t number_of_ids;
+  uint64_t max_string_length;
+};
+
+const char kImageMagic[8] = {'A', 'C', 'D', 'A', 'R', 'R', 'A', 'Y'};
+const uint32_t kImageVersion = 3;
+
+static_assert(sizeof(ImageHeader) == 40, "ImageHeader must not be padded");
+static_assert(sizeof(DoubleArrayCell) == 3 * sizeof(StateIndex),
+              "DoubleArrayCell must not be padded");
+static_assert(sizeof(size_t) == sizeof(uint64_t),
+              "Image stores string ids as 64-bit integers");
+
+inline size_t CellsSizeInImage(size_t number_of_cells) {
+  const size_t size = number_of_cells * sizeof(DoubleArrayCell);
+  return (size + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+}
+
+// Same as TerminatedStringTable, but over memory it does not own
+struct TerminatedStringView {
+  IteratorRange<const size_t *> Ids(StateIndex state) const {
+    return {ids + offsets[state], ids + offsets[state + 1]};
+  }
+
+  const size_t *offsets;
+  const size_t *ids;
+};
+
+}  // namespace internal
+
+void DoubleArrayAutomaton::Serialize(std::ostream &output_stream) const {
+  internal::ImageHeader header;
+  std::copy_n(internal::kImageMagic, sizeof(header.magic), header.magic);
+  header.version = internal::kImageVersion;
+  header.number_of_classes = static_cast<uint32_t>(number_of_classes_);
+  header.number_of_cells = cells_.size();
+  header.number_of_ids = terminated_strings_.ids.size();
+  header.max_string_length = max_string_length_;
+
+  const auto write = [&output_stream](const void *data, size_t size) {
+    output_stream.write(static_cast<const char *>(data), size);
+  };
+  write(&header, sizeof(header));
+  write(byte_classes_.data(), byte_classes_.size());
+  const size_t cells_size = cells_.size() * sizeof(DoubleArrayCell);
+  const char padding[sizeof(uint64_t)] = {};
+  write(cells_.data(), cells_size);
+  write(padding, internal::CellsSizeInImage(cells_.size()) - cells_size);
+  write(terminated_strings_.offsets.data(),
+        terminated_strings_.offsets.size() * sizeof(size_t));
+  write(terminated_strings_.ids.data(),
+        terminated_strings_.ids.size() * sizeof(size_t));
+}
+
+// Automaton scanning a serialized image in place. Construction checks
+// that every index stored in the image stays within its array and sets up
+// pointers, nothing is copied
+class AutomatonImage {
+ public:
+  AutomatonImage(const char *data, size_t size) {
+    internal::ImageHeader header;
+    if (size < sizeof(header) + kAlphabetSize) {
+      throw std::runtime_error("automaton image is truncated");
+    }
+    std::memcpy(&header, data, sizeof(header));
+    if (!std::equal(header.magic, header.magic + sizeof(header.magic),
+                    internal::kImageMagic) ||
+        header.version != internal::kImageVersion) {
+      throw std::runtime_error("not an automaton image");
+    }
+    // Counts which could not fit in the image are rejected first,
+    // so the sizes computed from them do not overflow
+    if (header.number_of_cells > size / sizeof(DoubleArrayCell) ||
+        header.number_of_ids > size / sizeof(size_t)) {
+      throw std::runtime_error("automaton image is truncated");
+    }
+    const size_t expected_size =
+        sizeof(header) + kAlphabetSize +
+        internal::CellsSizeInImage(header.number_of_cells) +
+        (header.number_of_cells + 1 + header.number_of_ids) * sizeof(size_t);
+    if (size != expected_size) {
+      throw std::runtime_error("automaton image is truncated");
+    }
+
+    const char *position = data + sizeof(header);
+    byte_classes_ = reinterpret_cast<const uint8_t *>(position);
+    position += kAlphabetSize;
+    cells_ = reinterpret_cast<const DoubleArrayCell *>(position);
+    position += internal::CellsSizeInImage(header.number_of_cells);
+    terminated_strings_.offsets = reinterpret_cast<const size_t *>(position);
+    position += (header.number_of_cells + 1) * sizeof(size_t);
+    terminated_strings_.ids = reinterpret_cast<const size_t *>(position);
+    max_string_length_ = header.max_string_length;
+    CheckIndices(header);
+  }
+
+  AutomatonImage(const AutomatonImage &) = delete;
+  AutomatonImage &operator=(const AutomatonImage &) = delete;
+
+  CompiledNodeReference<AutomatonImage> Root() const {
+    return CompiledNodeReference<AutomatonImage>(this, 0);
+  }
+
+  size_t MaxStringLength() const { return max_string_length_; }
+
+ private:
+  StateIndex Next(StateIndex state, char character) const {
+    return internal::NextInDoubleArray(cells_, byte_classes_, state,
+                                       character);
+  }
+
+  // A transition reads the cell at base + class and follows suffix links
+  // until the root, so every base is followed by number_of_classes cells
+  // and every chain of suffix links ends at the root
+  void CheckIndices(const internal::ImageHeader &header) const {
+    const size_t number_of_cells = header.number_of_cells;
+    const size_t number_of_classes = header.number_of_classes;
+    if (number_of_classes == 0 || number_of_classes > kAlphabetSize ||
+        number_of_cells < number_of_classes) {
+      throw std::runtime_error("automaton image is corrupted");
+    }
+    for (size_t byte = 0; byte < kAlphabetSize; ++byte) {
+      if (byte_classes_[byte] >= number_of_classes) {
+        throw std::runtime_error("automaton image is corrupted");
+      }
+    }
+    for (size_t cell = 0; cell < number_of_cells; ++cell) {
+      if (cells_[cell].base > number_of_cells - number_of_classes ||
+          cells_[cell].suffix_link >= number_of_cells) {
+        throw std::runtime_error("automaton image is corrupted");
+      }
+    }
+    const size_t *offsets = terminated_strings_.offsets;
+    if (offsets[0] != 0 || offsets[number_of_cells] != header.number_of_ids ||
+        !std::is_sorted(offsets, offsets + number_of_cells + 1)) {
+      throw std::runtime_error("automaton image is corrupted");
+    }
+
+    enum : uint8_t { kUnknown, kOnPath, kReachesRoot };
+    std::vector<uint8_t> marks(number_of_cells, kUnknown);
+    marks[0] = kReachesRoot;
+    for (size_t cell = 1; cell < number_of_cells; ++cell) {
+      size_t link = cell;
+      while (marks[link] == kUnknown) {
+        marks[link] = kOnPath;
+        link = cells_[link].suffix_link;
+      }
+      if (marks[link] == kOnPath) {
+        throw std::runtime_error("automaton image is corrupted");
+      }
+      for (link = cell; marks[link] == kOnPath;
+           link = cells_[link].suffix_link) {
+        marks[link] = kReachesRoot;
+      }
+    }
+  }
+
+  const uint8_t *byte_classes_;
+  const DoubleArrayCell *cells_;
+  internal::TerminatedStringView terminated_strings_;
+  size_t max_string_length_;
+
+  friend class CompiledNodeReference<AutomatonImage>;
+};
+
+typedef CompiledNodeReference<ArenaAutomaton> ArenaNodeReference;
+typedef CompiledNodeReference<DenseAutomaton> DenseNodeReference;
+typedef CompiledNodeReference<DoubleArrayAutomaton> DoubleArrayNodeReference;
+typedef CompiledNodeReference<AutomatonImage> ImageNodeReference;
+
+// Advances the automaton over several texts in lockstep. A step of one
+// stream does not depend on the steps of the others, so their
+// transition loads are in flight at the same time.
+// on_match(stream, position, id) gets the position following
+// the last character of the match within its stream
+template <size_t kNumberOfStreams, class Automaton, class Callback>
+void ScanInterleaved(
+    const Automaton &automaton,
+    const std::array<IteratorRange<const char *>, kNumberOfStreams> &streams,
+    Callback on_match) {
+  typedef decltype(automaton.Root()) State;
+  std::array<State, kNumberOfStreams> states;
+  states.fill(automaton.Root());
+  size_t common_length = std::numeric_limits<size_t>::max();
+  for (const auto &stream : streams) {
+    common_length = std::min<size_t>(common_length,
+                                     stream.end() - stream.begin());
+  }
+
+  for (size_t position = 0; position < common_length; ++position) {
+    for (size_t stream = 0; stream < kNumberOfStreams; ++stream) {
+      states[stream] = states[stream].Next(streams[stream].begin()[position]);
+    }
+    for (size_t stream = 0; stream < kNumberOfStreams; ++stream) {
+      states[stream].GenerateMatches([&on_match, stream, position](size_t id) {
+        on_match(stream, position + 1, id);
+      });
+    }
+  }
+
+  for (size_t stream = 0; stream < kNumberOfStreams; ++stream) {
+    const size_t length = streams[stream].end() - streams[stream].begin();
+    for (size_t position = common_length; position < length; ++position) {
+      states[stream] = states[stream].Next(streams[stream].begin()[position]);
+      states[stream].GenerateMatches([&on_match, stream, position](size_t id) {
+        on_match(stream, position + 1, id);
+      });
+    }
+  }
+}
+
+// Words are kept as views, so a builder is not copyable: copied views
+// would refer to the strings owned by the original
+class AutomatonBuilder {
+ public:
+  AutomatonBuilder() : number_of_threads_(DefaultNumberOfThreads()) {}
+
+  AutomatonBuilder(const AutomatonBuilder &) = delete;
+  AutomatonBuilder &operator=(const AutomatonBuilder &) = delete;
+  AutomatonBuilder(AutomatonBuilder &&) = default;
+  AutomatonBuilder &operator=(AutomatonBuilder &&) = default;
+
+  void Add(const std::string &string, size_t id) {
+    owned_words_.push_back(string);
+    const std::string &word = owned_words_.back();
+    AddView(WordView(word.data(), word.data() + word.size()), id);
+  }
+
+  // Characters of the word are not copied and have to outlive the builder
+  void AddView(WordView word, size_t id) {
+    words_.push_back(word);
+    ids_.push_back(id);
+  }
+
+  // Adds every line of a newline-delimited text as a word without copying
+  // it, ids continue the ones already added. A trailing carriage return
+  // is not a part of the word, empty lines are skipped
+  void AddLines(const char *data, size_t size) {
+    const char *const end = data + size;
+    while (data < end) {
+      const char *line_end = static_cast<const char *>(
+          std::memchr(data, '\n', end - data));
+      const char *const next_line = line_end ? line_end + 1 : end;
+      if (line_end == nullptr) {
+        line_end = end;
+      }
+      if (line_end > data && line_end[-1] == '\r') {
+        --line_end;
+      }
+      if (line_end > data) {
+        AddView(WordView(data, line_end), words_.size());
+      }
+      data = next_line;
+    }
+  }
+
+  // Adds copies of all the strings of other with their ids
+  void Merge(const AutomatonBuilder &other) {
+    for (size_t index = 0; index < other.words_.size(); ++index) {
+      Add(std::string(other.words_[index].begin(), other.words_[index].end()),
+          other.ids_[index]);
+    }
+  }
+
+  size_t NumberOfStrings() const { return words_.size(); }
+
+  // All the transitions are completed up front, so the built automaton
+  // is never modified and may be scanned from several threads at once
+  std::unique_ptr<const Automaton> Build() const {
+    auto automaton = make_unique<Automaton>();
+    BuildTrie(words_, ids_, automaton.get());
+    BuildLinks(Alphabet(words_), automaton.get());
+    return std::unique_ptr<const Automaton>(std::move(automaton));
+  }
+
+  // Links and terminated strings of the compiled automata are built
+  // by up to this number of threads
+  void SetNumberOfThreads(size_t number_of_threads) {
+    number_of_threads_ = std::max<size_t>(1, number_of_threads);
+  }
+
+  std::unique_ptr<ArenaAutomaton> BuildArena() const {
+    auto automaton = make_unique<ArenaAutomaton>();
+    BuildArenaTrie(words_, ids_, automaton.get());
+    BuildArenaLinks(automaton.get(), number_of_threads_);
+    FlattenTerminatedStrings(automaton.get(), number_of_threads_);
+    return automaton;
+  }
+
+  std::unique_ptr<DenseAutomaton> BuildDense() const {
+    const auto arena_automaton = BuildArena();
+    auto dense_automaton = make_unique<DenseAutomaton>();
+    Compile(*arena_automaton, dense_automaton.get());
+    return dense_automaton;
+  }
+
+  std::unique_ptr<DoubleArrayAutomaton> BuildDoubleArray() const {
+    const auto arena_automaton = BuildArena();
+    auto double_array_automaton = make_unique<DoubleArrayAutomaton>();
+    CompileDoubleArray(*arena_automaton, double_array_automaton.get());
+    for (const auto &word : words_) {
+      double_array_automaton->max_string_length_ =
+          std::max(double_array_automaton->max_string_length_, Length(word));
+    }
+    return double_array_automaton;
+  }
+
+ private:
+  static void BuildTrie(const std::vector<WordView> &words,
+                        const std::vector<size_t> &ids, Automaton *automaton) {
+    for (size_t i = 0; i < words.size(); ++i) {
+      AddString(&automaton->root_, ids[i], words[i]);
+    }
+  }
+
+  static void AddString(AutomatonNode *root, size_t string_id,
+                        WordView string) {
+    auto current_node = root;
+    for (const char symbol : string) {
+      current_node = &(current_node->trie_transitions[symbol]);
+    }
+    current_node->terminated_string_ids.push_back(string_id);
+  }
+
+  static void BuildLinks(const std::string &alphabet, Automaton *automaton) {
+    internal::LinkCalculator link_calculator(&automaton->root_, alphabet);
+    traverses::BreadthFirstSearch(
+        &automaton->root_,
+        internal::AutomatonGraph(),
+        link_calculator);
+  }
+
+  static std::string Alphabet(const std::vector<WordView> &words) {
+    std::vector<bool> occurs(kAlphabetSize, false);
+    std::string alphabet;
+    for (const auto &word : words) {
+      for (const char symbol : word) {
+        if (!occurs[static_cast<unsigned char>(symbol)]) {
+          occurs[static_cast<unsigned char>(symbol)] = true;
+          alphabet.push_back(symbol);
+        }
+      }
+    }
+    return alphabet;
+  }
+
+  // Sorted words sharing the prefix of a node form a contiguous range,
+  // so the trie is laid out level by level without searching for children
+  static void BuildArenaTrie(const std::vector<WordView> &words,
+                             const std::vector<size_t> &ids,
+                             ArenaAutomaton *automaton) {
+    std::vector<size_t> order(words.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&words](size_t lhs, size_t rhs) {
+                       return LexicographicallyLess(words[lhs], words[rhs]);
+                     });
+
+    auto &nodes = automaton->nodes_;
+    auto &terminated_strings = automaton->terminated_strings_;
+    nodes.assign(1, ArenaNode());
+    terminated_strings.offsets.assign(1, 0);
+    std::vector<std::pair<size_t, size_t>> ranges(1, {0, order.size()});
+
+    size_t depth = 0;
+    size_t level_end = 1;
+    for (size_t state = 0; state < nodes.size(); ++state) {
+      if (state == level_end) {
+        ++depth;
+        level_end = nodes.size();
+      }
+
+      size_t begin = ranges[state].first;
+      const size_t end = ranges[state].second;
+      while (begin < end && Length(words[order[begin]]) == depth) {
+        terminated_strings.ids.push_back(ids[order[begin]]);
+        ++begin;
+      }
+      terminated_strings.offsets.push_back(terminated_strings.ids.size());
+
+      nodes[state].first_child = static_cast<StateIndex>(nodes.size());
+      while (begin < end) {
+        const char character = words[order[begin]].begin()[depth];
+        size_t group_end = begin + 1;
+        while (group_end < end &&
+               words[order[group_end]].begin()[depth] == character) {
+          ++group_end;
+        }
+        nodes.emplace_back();
+        nodes.back().character = character;
+        ranges.emplace_back(begin, group_end);
+        begin = group_end;
+      }
+      nodes[state].number_of_children =
+          static_cast<uint16_t>(nodes.size() - nodes[state].first_child);
+    }
+  }
+
+  // Links of a node depend only on shallower nodes, so the trie is
+  // processed level by level and the nodes of a level are independent.
+  // Children of the nodes of a level form the next level
+  static void BuildArenaLinks(ArenaAutomaton *automaton,
+                              size_t number_of_threads) {
+    auto &nodes = automaton->nodes_;
+    size_t level_begin = 0;
+    size_t level_end = 1;
+    while (level_begin < level_end) {
+      ParallelFor(level_begin, level_end, number_of_threads,
+                  [automaton](size_t state) {
+                    BuildChildrenLinks(automaton, state);
+                  });
+      const ArenaNode &last_node = nodes[level_end - 1];
+      level_begin = level_end;
+      level_end = last_node.first_child + last_node.number_of_children;
+    }
+  }
+
+  static void BuildChildrenLinks(ArenaAutomaton *automaton, size_t state) {
+    auto &nodes = automaton->nodes_;
+    const StateIndex children_begin = nodes[state].first_child;
+    const StateIndex children_end =
+        children_begin + nodes[state].number_of_children;
+    for (StateIndex child = children_begin; child < children_end; ++child) {
+      const StateIndex suffix_link = (state == 0) ?
+          0 :
+          automaton->NextWhileBuilding(nodes[state].suffix_link,
+                                       nodes[child].character);
+      nodes[child].suffix_link = suffix_link;
+      nodes[child].terminal_link =
+          automaton->terminated_strings_.Empty(suffix_link) ?
+          nodes[suffix_link].terminal_link :
+          suffix_link;
+    }
+  }
+
+  // Every byte labelling a trie edge gets a class of its own,
+  // the rest share the last class. Returns the number of classes
+  static size_t ComputeByteClasses(
+      const ArenaAutomaton &arena_automaton,
+      std::array<uint8_t, kAlphabetSize> *byte_classes) {
+    constexpr size_t kUnassigned = kAlphabetSize;
+    std::array<size_t, kAlphabetSize> classes;
+    classes.fill(kUnassigned);
+    size_t number_of_classes = 0;
+    for (size_t state = 1; state < arena_automaton.nodes_.size(); ++state) {
+      const auto byte =
+          static_cast<unsigned char>(arena_automaton.nodes_[state].character);
+      if (classes[byte] == kUnassigned) {
+        classes[byte] = number_of_classes++;
+      }
+    }
+    const size_t rest_class = number_of_classes;
+    if (number_of_classes < kAlphabetSize) {
+      ++number_of_classes;
+    }
+    for (size_t byte = 0; byte < kAlphabetSize; ++byte) {
+      (*byte_classes)[byte] = static_cast<uint8_t>(
+          classes[byte] == kUnassigned ? rest_class : classes[byte]);
+    }
+    return number_of_classes;
+  }
+
+  // Slice of a state is its own ids followed by the own ids of every
+  // state along its terminal links. Slices are sized and then filled
+  // independently of each other
+  static void FlattenTerminatedStrings(ArenaAutomaton *automaton,
+                                       size_t number_of_threads) {
+    const auto &nodes = automaton->nodes_;
+    const auto &own_strings = automaton->terminated_strings_;
+    internal::TerminatedStringTable strings;
+    strings.offsets.assign(nodes.size() + 1, 0);
+    ParallelFor(0, nodes.size(), number_of_threads,
+                [&](size_t state) {
+                  size_t size = 0;
+                  for (StateIndex terminal = state; terminal != kNoState;
+                       terminal = nodes[terminal].terminal_link) {
+                    size += own_strings.offsets[terminal + 1] -
+                            own_strings.offsets[terminal];
+                  }
+                  strings.offsets[state + 1] = size;
+                });
+    std::partial_sum(strings.offsets.begin(), strings.offsets.end(),
+                     strings.offsets.begin());
+    strings.ids.resize(strings.offsets.back());
+    ParallelFor(0, nodes.size(), number_of_threads,
+                [&](size_t state) {
+                  size_t *output = strings.ids.data() + strings.offsets[state];
+                  for (StateIndex terminal = state; terminal != kNoState;
+                       terminal = nodes[terminal].terminal_link) {
+                    for (const size_t id : own_strings.Ids(terminal)) {
+                      *output++ = id;
+                    }
+                  }
+                });
+    automaton->terminated_strings_ = std::move(strings);
+  }
+
+  // Missing transitions of a state are inherited from the already
+  // filled row of its suffix link
+  static void Compile(const ArenaAutomaton &arena_automaton,
+                      DenseAutomaton *dense_automaton) {
+    const size_t number_of_classes = ComputeByteClasses(
+        arena_automaton, &dense_automaton->byte_classes_);
+    dense_automaton->number_of_classes_ = number_of_classes;
+    const auto &nodes = arena_automaton.nodes_;
+    dense_automaton->transitions_.assign(nodes.size() * number_of_classes, 0);
+    for (size_t state = 0; state < nodes.size(); ++state) {
+      const ArenaNode &node = nodes[state];
+      StateIndex *row =
+          &dense_automaton->transitions_[state * number_of_classes];
+      if (state != 0) {
+        const StateIndex *suffix_link_row =
+            &dense_automaton->transitions_[node.suffix_link *
+                                           number_of_classes];
+        std::copy_n(suffix_link_row, number_of_classes, row);
+      }
+      const StateIndex children_end =
+          node.first_child + node.number_of_children;
+      for (StateIndex child = node.first_child; child < children_end; ++child) {
+        const auto byte = static_cast<unsigned char>(nodes[child].character);
+        row[dense_automaton->byte_classes_[byte]] = child;
+      }
+    }
+    dense_automaton->terminated_strings_ = arena_automaton.terminated_strings_;
+  }
+
+  // States are placed in breadth-first order, each choosing the first
+  // base under which all its children land in free cells
+  static void CompileDoubleArray(const ArenaAutomaton &arena_automaton,
+                                 DoubleArrayAutomaton *automaton) {
+    const size_t number_of_classes = ComputeByteClasses(
+        arena_automaton, &automaton->byte_classes_);
+    automaton->number_of_classes_ = number_of_classes;
+    const auto &nodes = arena_automaton.nodes_;
+    auto &cells = automaton->cells_;
+
+    std::vector<StateIndex> cell_of_state(nodes.size(), kNoState);
+    internal::FreeCells free_cells;
+    free_cells.Occupy(0);
+    cell_of_state[0] = 0;
+    cells.assign(1, DoubleArrayCell());
+    std::vector<size_t> codes;
+    for (size_t state = 0; state < nodes.size(); ++state) {
+      const ArenaNode &node = nodes[state];
+      const StateIndex children_end =
+          node.first_child + node.number_of_children;
+      codes.clear();
+      for (StateIndex child = node.first_child; child < children_end; ++child) {
+        const auto byte = static_cast<unsigned char>(nodes[child].character);
+        codes.push_back(automaton->byte_classes_[byte]);
+      }
+      if (codes.empty()) {
+        continue;
+      }
+
+      const size_t base = free_cells.FindBase(codes);
+      const StateIndex cell = cell_of_state[state];
+      cells[cell].base = static_cast<StateIndex>(base);
+      for (size_t index = 0; index < codes.size(); ++index) {
+        const size_t child_cell = base + codes[index];
+        free_cells.Occupy(child_cell);
+        if (child_cell >= cells.size()) {
+          cells.resize(child_cell + 1);
+        }
+        cells[child_cell].check = cell;
+        cell_of_state[node.first_child + index] =
+            static_cast<StateIndex>(child_cell);
+      }
+    }
+
+    std::vector<StateIndex> state_of_cell(cells.size(), kNoState);
+    for (size_t state = 0; state < nodes.size(); ++state) {
+      const StateIndex cell = cell_of_state[state];
+      state_of_cell[cell] = static_cast<StateIndex>(state);
+      cells[cell].suffix_link = cell_of_state[nodes[state].suffix_link];
+    }
+
+    const auto &arena_strings = arena_automaton.terminated_strings_;
+    auto &terminated_strings = automaton->terminated_strings_;
+    cells.resize(cells.size() + number_of_classes);
+    terminated_strings.offsets.assign(1, 0);
+    terminated_strings.ids.clear();
+    for (size_t cell = 0; cell < cells.size(); ++cell) {
+      if (cell < state_of_cell.size() && state_of_cell[cell] != kNoState) {
+        for (const size_t id : arena_strings.Ids(state_of_cell[cell])) {
+          terminated_strings.ids.push_back(id);
+        }
+      }
+      terminated_strings.offsets.push_back(terminated_strings.ids.size());
+    }
+  }
+
+  // Strings passed to Add. Elements of a deque never move,
+  // so the views of them stay valid
+  std::deque<std::string> owned_words_;
+  std::vector<WordView> words_;
+  std::vector<size_t> ids_;
+  size_t number_of_threads_;
+};
+
+// Set of strings growing one string at a time. Strings are kept in
+// levels of automata, each level at least twice as large as the next one,
+// like the digits of a binary counter. Adding a string builds a level
+// of one string and merges equal levels, so a string takes part in
+// O(log n) rebuilds and no addition rebuilds the whole set
+// unless the set doubles.
+// Add and Root may be called from different threads: Add rebuilds the
+// levels on its own and then publishes the new list of automata, which
+// Root only copies
+class IncrementalAutomaton {
+ public:
+  // Cursor keeps the automata it was created with alive, so it may
+  // finish its scan over the old set while strings are being added
+  class Cursor {
+   public:
+    void Next(char character) {
+      for (auto &state : states_) {
+        state = state.Next(character);
+      }
+    }
+
+    template <class Callback>
+    void GenerateMatches(Callback on_match) const {
+      for (const auto &state : states_) {
+        state.GenerateMatches(on_match);
+      }
+    }
+
+   private:
+    std::vector<std::shared_ptr<const DoubleArrayAutomaton>> automata_;
+    std::vector<DoubleArrayNodeReference> states_;
+
+    friend class IncrementalAutomaton;
+  };
+
+  IncrementalAutomaton() : automata_(std::make_shared<AutomatonList>()) {}
+
+  IncrementalAutomaton(const IncrementalAutomaton &) = delete;
+  IncrementalAutomaton &operator=(const IncrementalAutomaton &) = delete;
+
+  void Add(const std::string &string, size_t id) {
+    std::lock_guard<std::mutex> levels_lock(levels_mutex_);
+    levels_.emplace_back();
+    levels_.back().builder.Add(string, id);
+    while (levels_.size() > 1 &&
+           levels_[levels_.size() - 2].builder.NumberOfStrings() <=
+               levels_.back().builder.NumberOfStrings()) {
+      levels_[levels_.size() - 2].builder.Merge(levels_.back().builder);
+      levels_.pop_back();
+    }
+    levels_.back().automaton = levels_.back().builder.BuildDoubleArray();
+
+    auto automata = std::make_shared<AutomatonList>();
+    for (const auto &level : levels_) {
+      automata->push_back(level.automaton);
+    }
+    std::lock_guard<std::mutex> automata_lock(automata_mutex_);
+    automata_ = std::move(automata);
+  }
+
+  Cursor Root() const {
+    Cursor cursor;
+    cursor.automata_ = *Automata();
+    for (const auto &automaton : cursor.automata_) {
+      cursor.states_.push_back(automaton->Root());
+    }
+    return cursor;
+  }
+
+  size_t NumberOfLevels() const { return Automata()->size(); }
+
+ private:
+  typedef std::vector<std::shared_ptr<const DoubleArrayAutomaton>>
+      AutomatonList;
+
+  struct Level {
+    AutomatonBuilder builder;
+    std::shared_ptr<const DoubleArrayAutomaton> automaton;
+  };
+
+  std::shared_ptr<const AutomatonList> Automata() const {
+    std::lock_guard<std::mutex> automata_lock(automata_mutex_);
+    return automata_;
+  }
+
+  // Serializes the additions
+  std::mutex levels_mutex_;
+  std::vector<Level> levels_;
+  // Published list of the automata of all the levels, never modified
+  mutable std::mutex automata_mutex_;
+  std::shared_ptr<const AutomatonList> automata_;
+};
+
+}  // namespace aho_corasick
+
+// Consecutive delimiters are not grouped together and are deemed
+// to delimit empty strings
+template <class Predicate>
+std::vector<std::string> Split(const std::string &string,
+                               Predicate is_delimiter) {
+  std::vector<std::string> substrings;
+  std::string current_string = "";
+  for (const char symbol : string) {
+    if (is_delimiter(symbol)) {
+      substrings.push_back(std::move(current_string));
+      current_string.clear();
+    } else {
+      current_string.push_back(symbol);
+    }
+  }
+
+  if (!current_string.empty()) {
+    substrings.push_back(std::move(current_string));
+  }
+
+  return substrings;
+}
+
+// Keeps a counter for each of the last |window_length| positions of a stream,
+// or any other value per position, such as the character found there.
+// The ring is allocated once and its power-of-two capacity turns the position
+// to slot mapping into a single mask
+template <class Counter>
+class CounterRing {
+ public:
+  CounterRing() : mask_(0) {}
+
+  void Init(size_t window_length) {
+    size_t capacity = 1;
+    while (capacity < window_length) {
+      capacity *= 2;
+    }
+    counters_.assign(capacity, Counter());
+    mask_ = capacity - 1;
+  }
+
+  void Clear() {
+    counters_.clear();
+    counters_.shrink_to_fit();
+    mask_ = 0;
+  }
+
+  bool Empty() const { return counters_.empty(); }
+
+  size_t Capacity() const { return counters_.size(); }
+
+  Counter &operator[](size_t position) { return counters_[position & mask_]; }
+
+ private:
+  std::vector<Counter> counters_;
+  size_t mask_;
+};
+
+namespace simd {
+
+// Returns the first position where first is followed by second.
+// The last position of the range is returned if it holds first,
+// since the character following it is unknown
+inline const char *FindBytePair(const char *begin, const char *end,
+                                char first, char second) {
+  const char *position = begin;
+#if defined(__AVX2__)
+  const __m256i first_bytes = _mm256_set1_epi8(first);
+  const __m256i second_bytes = _mm256_set1_epi8(second);
+  for (; position + 32 < end; position += 32) {
+    const __m256i current = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(position));
+    const __m256i next = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(position + 1));
+    const uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(current, first_bytes),
+                         _mm256_cmpeq_epi8(next, second_bytes))));
+    if (mask != 0) {
+      return position + __builtin_ctz(mask);
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128i first_bytes = _mm_set1_epi8(first);
+  const __m128i second_bytes = _mm_set1_epi8(second);
+  for (; position + 16 < end; position += 16) {
+    const __m128i current =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(position));
+    const __m128i next =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(position + 1));
+    const uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(current, first_bytes),
+                      _mm_cmpeq_epi8(next, second_bytes))));
+    if (mask != 0) {
+      return position + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; position < end; ++position) {
+    if (*position == first && (position + 1 == end || position[1] == second)) {
+      return position;
+    }
+  }
+  return end;
+}
+
+inline const char *FindByte(const char *begin, const char *end, char byte) {
+  const void *position = std::memchr(begin, byte, end - begin);
+  return (position != nullptr) ? static_cast<const char *>(position) : end;
+}
+
+}  // namespace simd
+
+// Rough share of a byte in natural text, enough to tell rare bytes
+double EstimatedByteFrequency(char byte) {
+  static const char kLettersByFrequency[] = "etaoinshrdlcumwfgypbvkjxqz";
+  constexpr double kSpaceFrequency = 0.15;
+  constexpr double kMostFrequentLetter = 0.1;
+  constexpr double kLetterDecay = 0.87;
+  constexpr double kCapitalShare = 0.05;
+  constexpr double kDigitFrequency = 0.003;
+  constexpr double kOtherFrequency = 0.001;
+
+  if (byte == ' ') {
+    return kSpaceFrequency;
+  }
+  const bool is_capital = (byte >= 'A' && byte <= 'Z');
+  const char letter = is_capital ? byte - 'A' + 'a' : byte;
+  const char *rank = std::strchr(kLettersByFrequency, letter);
+  if (letter != 0 && rank != nullptr) {
+    const double frequency = kMostFrequentLetter *
+        std::pow(kLetterDecay, static_cast<double>(rank - kLettersByFrequency));
+    return is_capital ? frequency * kCapitalShare : frequency;
+  }
+  return (byte >= '0' && byte <= '9') ? kDigitFrequency : kOtherFrequency;
+}
+
+// Wildcard is a character that may be substituted
+// for any of all possible characters
+class WildcardMatcher {
+ public:
+  WildcardMatcher()
+      : number_of_words_(0), pattern_length_(0), scanned_length_(0),
+        has_anchor_(false), anchor_offset_(0), anchor_length_(0),
+        resume_position_(0), synced_length_(0), required_length_(0) {}
+
+  void Init(const std::string &pattern, char wildcard) {
+    aho_corasick::AutomatonBuilder builder;
+    const std::vector<std::string> patterns = Split(
+        pattern,
+        [wildcard](char symbol) -> bool {
+          return symbol == wildcard;
+        });
+
+    size_t total_length = 0;
+    size_t number_of_words = 0;
+    for (const auto& pattern : patterns) {
+      total_length += pattern.length();
+      if (!pattern.empty()) {
+        builder.Add(pattern, total_length);
+        ++number_of_words;
+      }
+      ++total_length;
+    }
+
+    number_of_words_ = number_of_words;
+    pattern_length_ = pattern.length();
+    InitWordOccurrences();
+    ChooseAnchor(patterns);
+    history_.Init(anchor_offset_);
+
+    aho_corasick_automaton_ = std::move(builder.BuildDense());
+    Reset();
+  }
+
+  // Resets matcher to start scanning new stream
+  void Reset() {
+    state_ = aho_corasick_automaton_->Root();
+    scanned_length_ = 0;
+    resume_position_ = 0;
+    synced_length_ = 0;
+    required_length_ = 0;
+  }
+
+  template <class Callback>
+  void Scan(char character, Callback on_match) {
+    size_t match;
+    if (ScanBlock(&character, 1, &match) != &match) {
+      on_match();
+    }
+  }
+
+  // Writes the offset in the stream of the first character of every match
+  // ending within the block, so a plain pointer to a buffer of |size|
+  // elements may serve as the output iterator
+  template <class OutputIterator>
+  OutputIterator ScanBlock(const char *data, size_t size, OutputIterator out) {
+    if (!narrow_occurrences_.Empty()) {
+      out = ScanBlock(data, size, out, &narrow_occurrences_);
+    } else if (!medium_occurrences_.Empty()) {
+      out = ScanBlock(data, size, out, &medium_occurrences_);
+    } else {
+      out = ScanBlock(data, size, out, &wide_occurrences_);
+    }
+    UpdateHistory(data, size);
+    scanned_length_ += size;
+    return out;
+  }
+
+  // ScanBlock holds no match back, see NttWildcardMatcher::Flush
+  template <class OutputIterator>
+  OutputIterator Flush(OutputIterator out) {
+    return out;
+  }
+
+ private:
+  // A counter never exceeds number_of_words_,
+  // so the narrowest sufficient type is chosen
+  void InitWordOccurrences() {
+    narrow_occurrences_.Clear();
+    medium_occurrences_.Clear();
+    wide_occurrences_.Clear();
+    if (number_of_words_ <= std::numeric_limits<uint8_t>::max()) {
+      narrow_occurrences_.Init(pattern_length_);
+    } else if (number_of_words_ <= std::numeric_limits<uint16_t>::max()) {
+      medium_occurrences_.Init(pattern_length_);
+    } else {
+      wide_occurrences_.Init(pattern_length_);
+    }
+  }
+
+  // Every match contains the anchor at anchor_offset_, so only the text
+  // around occurrences of its first bytes needs to be fed to the automaton.
+  // The fragment whose first bytes are estimated to be the rarest is chosen
+  void ChooseAnchor(const std::vector<std::string> &fragments) {
+    has_anchor_ = false;
+    double best_frequency = 0;
+    size_t offset = 0;
+    for (const auto &fragment : fragments) {
+      if (!fragment.empty()) {
+        double frequency = EstimatedByteFrequency(fragment[0]);
+        if (fragment.size() > 1) {
+          frequency *= EstimatedByteFrequency(fragment[1]);
+        }
+        if (!has_anchor_ || frequency < best_frequency) {
+          has_anchor_ = true;
+          best_frequency = frequency;
+          anchor_offset_ = offset;
+          anchor_length_ = std::min<size_t>(fragment.size(), 2);
+          anchor_[0] = fragment[0];
+          anchor_[1] = fragment[anchor_length_ - 1];
+        }
+      }
+      offset += fragment.size() + 1;
+    }
+  }
+
+  const char *FindAnchor(const char *begin, const char *end) const {
+    return (anchor_length_ == 2) ?
+        simd::FindBytePair(begin, end, anchor_[0], anchor_[1]) :
+        simd::FindByte(begin, end, anchor_[0]);
+  }
+
+  // Keeps the last anchor_offset_ characters of the stream,
+  // as a match may start that far before its anchor. Only the characters
+  // that stay in the ring are written, so a block of one character
+  // costs constant time
+  void UpdateHistory(const char *data, size_t size) {
+    if (!has_anchor_) {
+      return;
+    }
+    for (size_t index = size - std::min(size, anchor_offset_); index < size;
+         ++index) {
+      history_[scanned_length_ + index] = data[index];
+    }
+  }
+
+  // The automaton is fed from synced_length_ up to required_length_,
+  // which is extended by every anchor candidate. When the next candidate
+  // lies beyond that, the characters between are skipped and the automaton
+  // restarts from the root at the first position its match may have
+  template <class OutputIterator, class Counter>
+  OutputIterator ScanBlock(const char *data, size_t size, OutputIterator out,
+                           CounterRing<Counter> *occurrences) {
+    const size_t block_begin = scanned_length_;
+    const size_t block_end = scanned_length_ + size;
+    if (!has_anchor_) {
+      return FeedUpTo(data, block_end, out, occurrences);
+    }
+
+    const char *search_begin = data;
+    while (true) {
+      const char *candidate = FindAnchor(search_begin, data + size);
+      if (candidate == data + size) {
+        break;
+      }
+      search_begin = candidate + 1;
+
+      const size_t anchor_position = block_begin + (candidate - data);
+      if (anchor_position < anchor_offset_) {
+        continue;
+      }
+      const size_t match_begin = anchor_position - anchor_offset_;
+      if (match_begin > synced_length_) {
+        out = FeedUpTo(data, std::min(required_length_, block_end), out,
+                       occurrences);
+        if (match_begin > synced_length_) {
+          COUNT_EVENT(prefilter_restarts);
+          state_ = aho_corasick_automaton_->Root();
+          resume_position_ = match_begin;
+          synced_length_ = match_begin;
+        }
+      }
+      required_length_ =
+          std::max(required_length_, match_begin + pattern_length_);
+    }
+    return FeedUpTo(data, std::min(required_length_, block_end), out,
+                    occurrences);
+  }
+
+  // Feeds the characters from synced_length_ up to end,
+  // taking those preceding the block from the history
+  template <class OutputIterator, class Counter>
+  OutputIterator FeedUpTo(const char *data, size_t end, OutputIterator out,
+                      CounterRing<Counter> *occurrences) {
+    if (synced_length_ >= end) {
+      return out;
+    }
+    // The characters are contiguous in the ring up to its wrap
+    while (synced_length_ < scanned_length_) {
+      const size_t slot = synced_length_ % history_.Capacity();
+      out = Feed(&history_[synced_length_],
+                 std::min(scanned_length_ - synced_length_,
+                          history_.Capacity() - slot),
+                 out, occurrences);
+    }
+    const size_t data_begin = synced_length_ - scanned_length_;
+    return Feed(data + data_begin, end - synced_length_, out, occurrences);
+  }
+
+  template <class OutputIterator, class Counter>
+  OutputIterator Feed(const char *data, size_t size, OutputIterator out,
+                      CounterRing<Counter> *occurrences) {
+    auto state = state_;
+    size_t position = synced_length_;
+    for (size_t index = 0; index < size; ++index, ++position) {
+      state = state.Next(data[index]);
+      if (UpdateWordOccurrences(state, position, occurrences)) {
+        *out++ = position + 1 - pattern_length_;
+      }
+    }
+    state_ = state;
+    synced_length_ = position;
+    return out;
+  }
+
+  // Counter of a position is the number of pattern words found
+  // at their places if the pattern starts there.
+  // Returns whether the whole pattern ends at the given position
+  template <class Counter>
+  bool UpdateWordOccurrences(aho_corasick::DenseNodeReference state,
+                             size_t position,
+                             CounterRing<Counter> *occurrences) {
+    (*occurrences)[position] = 0;
+    state.GenerateMatches(
+        [position, occurrences](size_t id) {
+          if (position + 1 >= id) {
+            COUNT_EVENT(counter_increments);
+            ++(*occurrences)[position + 1 - id];
+          }
+        });
+
+    // Counters of positions preceding the restart of the automaton are stale
+    if (position + 1 < resume_position_ + pattern_length_) {
+      return false;
+    }
+    return (*occurrences)[position + 1 - pattern_length_] == number_of_words_;
+  }
+
+  // Storing only O(|pattern|) elements allows us
+  // to consume only O(|pattern|) memory for matcher.
+  // Exactly one of the rings is allocated
+  CounterRing<uint8_t> narrow_occurrences_;
+  CounterRing<uint16_t> medium_occurrences_;
+  CounterRing<uint32_t> wide_occurrences_;
+  aho_corasick::DenseNodeReference state_;
+  size_t number_of_words_;
+  size_t pattern_length_;
+  // Copies of a matcher share the automaton and scan independently
+  std::shared_ptr<const aho_corasick::DenseAutomaton> aho_corasick_automaton_;
+  size_t scanned_length_;
+
+  bool has_anchor_;
+  size_t anchor_offset_;
+  // First one or two characters of the anchor
+  size_t anchor_length_;
+  char anchor_[2];
+  // Last anchor_offset_ characters of the stream by their positions
+  CounterRing<char> history_;
+  // Automaton has been fed continuously from resume_position_
+  // up to synced_length_
+  size_t resume_position_;
+  size_t synced_length_;
+  size_t required_length_;
+};
+
+// Matches a set of wildcard patterns in one pass. Fragments of all the
+// patterns share one automaton, and a fragment id refers to its pattern
+// and to its end offset within it. Counters are reset lazily by
+// the start position they count for, so a character costs time
+// proportional to the fragments found there rather than to the number
+// of patterns
+class MultiWildcardMatcher {
+ public:
+  MultiWildcardMatcher() : scanned_length_(0) {}
+
+  void Init(const std::vector<std::string> &patterns, char wildcard) {
+    aho_corasick::AutomatonBuilder builder;
+    fragments_.clear();
+    patterns_.assign(patterns.size(), PatternInfo());
+    occurrences_.assign(patterns.size(), CounterRing<StampedCounter>());
+    wildcard_patterns_.clear();
+    for (size_t pattern = 0; pattern < patterns.size(); ++pattern) {
+      const std::vector<std::string> words = Split(
+          patterns[pattern],
+          [wildcard](char symbol) -> bool {
+            return symbol == wildcard;
+          });
+      size_t total_length = 0;
+      for (const auto &word : words) {
+        total_length += word.length();
+        if (!word.empty()) {
+          builder.Add(word, fragments_.size());
+          fragments_.push_back({pattern, total_length});
+          ++patterns_[pattern].number_of_words;
+        }
+        ++total_length;
+      }
+      patterns_[pattern].length = patterns[pattern].length();
+      occurrences_[pattern].Init(patterns[pattern].length());
+      if (patterns_[pattern].number_of_words == 0 &&
+          patterns_[pattern].length > 0) {
+        wildcard_patterns_.push_back(pattern);
+      }
+    }
+    aho_corasick_automaton_ = std::move(builder.BuildDense());
+    Reset();
+  }
+
+  // Resets matcher to start scanning new stream
+  void Reset() {
+    state_ = aho_corasick_automaton_->Root();
+    scanned_length_ = 0;
+    pending_matches_ = PendingMatchQueue();
+    for (auto &occurrences : occurrences_) {
+      for (size_t slot = 0; slot < occurrences.Capacity(); ++slot) {
+        occurrences[slot] = StampedCounter();
+      }
+    }
+  }
+
+  // Writes a (pattern index, offset of the first character) pair
+  // for every match ending within the block. Matches are ordered
+  // by their last character, then by pattern index
+  template <class OutputIterator>
+  OutputIterator ScanBlock(const char *data, size_t size, OutputIterator out) {
+    auto state = state_;
+    size_t position = scanned_length_;
+    for (size_t index = 0; index < size; ++index, ++position) {
+      state = state.Next(data[index]);
+      state.GenerateMatches([this, position](size_t fragment) {
+        CountFragment(fragments_[fragment], position);
+      });
+      for (const size_t pattern : wildcard_patterns_) {
+        if (position + 1 >= patterns_[pattern].length) {
+          pending_matches_.emplace(position, pattern,
+                                   position + 1 - patterns_[pattern].length);
+        }
+      }
+      while (!pending_matches_.empty() &&
+             std::get<0>(pending_matches_.top()) == position) {
+        *out++ = std::make_pair(std::get<1>(pending_matches_.top()),
+                                std::get<2>(pending_matches_.top()));
+        pending_matches_.pop();
+      }
+    }
+    state_ = state;
+    scanned_length_ = position;
+    return out;
+  }
+
+  size_t NumberOfPatterns() const { return patterns_.size(); }
+
+ private:
+  struct Fragment {
+    size_t pattern;
+    // Offset following the last character of the fragment in the pattern
+    size_t end;
+  };
+
+  struct PatternInfo {
+    PatternInfo() : length(0), number_of_words(0) {}
+
+    size_t length;
+    size_t number_of_words;
+  };
+
+  // Number of words found for the pattern starting at start
+  struct StampedCounter {
+    StampedCounter() : start(std::numeric_limits<size_t>::max()), count(0) {}
+
+    size_t start;
+    size_t count;
+  };
+
+  // Completed matches wait until the pattern, which may end
+  // with wildcards, fits into the stream.
+  // Holds (last position, pattern, start) triples
+  typedef std::tuple<size_t, size_t, size_t> PendingMatch;
+  typedef std::priority_queue<PendingMatch, std::vector<PendingMatch>,
+                              std::greater<PendingMatch>> PendingMatchQueue;
+
+  void CountFragment(const Fragment &fragment, size_t position) {
+    if (position + 1 < fragment.end) {
+      return;
+    }
+    const size_t start = position + 1 - fragment.end;
+    StampedCounter &counter = occurrences_[fragment.pattern][start];
+    if (counter.start != start) {
+      counter.start = start;
+      counter.count = 0;
+    }
+    const PatternInfo &pattern = patterns_[fragment.pattern];
+    COUNT_EVENT(counter_increments);
+    if (++counter.count == pattern.number_of_words) {
+      pending_matches_.emplace(start + pattern.length - 1, fragment.pattern,
+                               start);
+    }
+  }
+
+  std::vector<Fragment> fragments_;
+  std::vector<PatternInfo> patterns_;
+  // A window of |pattern| start positions for each pattern
+  std::vector<CounterRing<StampedCounter>> occurrences_;
+  // Patterns without words match everywhere
+  std::vector<size_t> wildcard_patterns_;
+  PendingMatchQueue pending_matches_;
+  aho_corasick::DenseNodeReference state_;
+  std::shared_ptr<const aho_corasick::DenseAutomaton> aho_corasick_automaton_;
+  size_t scanned_length_;
+};
+
+// Bit-parallel matcher for short patterns: bit i of the state tells whether
+// the first i + 1 characters of the pattern end at the current position.
+// Wildcards are handled natively, as their bits are set in every mask
+class ShiftAndMatcher {
+ public:
+  static const size_t kMaxPatternLength = 256;
+
+  ShiftAndMatcher() : pattern_length_(0), number_of_words_(0),
+                      scanned_length_(0) {}
+
+  static bool Supports(const std::string &pattern) {
+    return !pattern.empty() && pattern.length() <= kMaxPatternLength;
+  }
+
+  void Init(const std::string &pattern, char wildcard) {
+    pattern_length_ = pattern.length();
+    number_of_words_ = (pattern_length_ + kWordLength - 1) / kWordLength;
+    masks_.assign(aho_corasick::kAlphabetSize * number_of_words_, 0);
+    for (size_t index = 0; index < pattern_length_; ++index) {
+      const uint64_t bit = uint64_t(1) << (index % kWordLength);
+      const size_t word = index / kWordLength;
+      if (pattern[index] == wildcard) {
+        for (size_t symbol = 0; symbol < aho_corasick::kAlphabetSize;
+             ++symbol) {
+          masks_[symbol * number_of_words_ + word] |= bit;
+        }
+      } else {
+        const auto symbol = static_cast<unsigned char>(pattern[index]);
+        masks_[symbol * number_of_words_ + word] |= bit;
+      }
+    }
+    Reset();
+  }
+
+  // Resets matcher to start scanning new stream
+  void Reset() {
+    state_.fill(0);
+    scanned_length_ = 0;
+  }
+
+  template <class Callback>
+  void Scan(char character, Callback on_match) {
+    size_t match;
+    if (ScanBlock(&character, 1, &match) != &match) {
+      on_match();
+    }
+  }
+
+  // Same contract as WildcardMatcher::ScanBlock
+  template <class OutputIterator>
+  OutputIterator ScanBlock(const char *data, size_t size, OutputIterator out) {
+    switch (number_of_words_) {
+      case 1:
+        return ScanBlock<1>(data, size, out);
+      case 2:
+        return ScanBlock<2>(data, size, out);
+      case 3:
+        return ScanBlock<3>(data, size, out);
+      default:
+        return ScanBlock<4>(data, size, out);
+    }
+  }
+
+  template <class OutputIterator>
+  OutputIterator Flush(OutputIterator out) {
+    return out;
+  }
+
+ private:
+  static const size_t kWordLength = 64;
+  static const size_t kMaxNumberOfWords = kMaxPatternLength / kWordLength;
+
+  template <size_t kNumberOfWords, class OutputIterator>
+  OutputIterator ScanBlock(const char *data, size_t size, OutputIterator out) {
+    const size_t last_word = (pattern_length_ - 1) / kWordLength;
+    const uint64_t last_bit =
+        uint64_t(1) << ((pattern_length_ - 1) % kWordLength);
+
+    std::array<uint64_t, kNumberOfWords> state;
+    std::copy_n(state_.begin(), kNumberOfWords, state.begin());
+    size_t position = scanned_length_;
+    for (size_t index = 0; index < size; ++index, ++position) {
+      const uint64_t *mask =
+          &masks_[static_cast<unsigned char>(data[index]) * kNumberOfWords];
+      for (size_t word = kNumberOfWords - 1; word > 0; --word) {
+        state[word] = ((state[word] << 1) | (state[word - 1] >> 63)) &
+                      mask[word];
+      }
+      state[0] = ((state[0] << 1) | 1) & mask[0];
+      if (state[last_word] & last_bit) {
+        *out++ = position + 1 - pattern_length_;
+      }
+    }
+    std::copy_n(state.begin(), kNumberOfWords, state_.begin());
+    scanned_length_ = position;
+    return out;
+  }
+
+  size_t pattern_length_;
+  size_t number_of_words_;
+  // Masks of a character occupy number_of_words_ consecutive words
+  std::vector<uint64_t> masks_;
+  std::array<uint64_t, kMaxNumberOfWords> state_;
+  size_t scanned_length_;
+};
+
+const size_t ShiftAndMatcher::kMaxPatternLength;
+
+namespace ntt {
+
+// Arithmetic modulo the prime 2^64 - 2^32 + 1. Its multiplicative group
+// has elements of order 2^32, so transforms of any practical length exist
+const uint64_t kModulus = 0xFFFFFFFF00000001ULL;
+const uint64_t kGenerator = 7;
+// 2^64 is congruent to kEpsilon and 2^96 to -1
+const uint64_t kEpsilon = 0xFFFFFFFFULL;
+
+// Carries and borrows are applied with masks rather than branches,
+// as they are unpredictable inside transforms
+uint64_t Add(uint64_t lhs, uint64_t rhs) {
+  uint64_t sum = lhs + rhs;
+  sum += -static_cast<uint64_t>(sum < lhs) & kEpsilon;
+  return sum - (-static_cast<uint64_t>(sum >= kModulus) & kModulus);
+}
+
+uint64_t Subtract(uint64_t lhs, uint64_t rhs) {
+  const uint64_t difference = lhs - rhs;
+  return difference - (-static_cast<uint64_t>(lhs < rhs) & kEpsilon);
+}
+
+uint64_t Multiply(uint64_t lhs, uint64_t rhs) {
+  const unsigned __int128 product = static_cast<unsigned __int128>(lhs) * rhs;
+  const uint64_t low = static_cast<uint64_t>(product);
+  const uint64_t high = static_cast<uint64_t>(product >> 64);
+  const uint64_t high_high = high >> 32;
+  const uint64_t high_low = high & kEpsilon;
+
+  uint64_t result = low - high_high;
+  result -= -static_cast<uint64_t>(low < high_high) & kEpsilon;
+  const uint64_t addend = high_low * kEpsilon;
+  const uint64_t sum = result + addend;
+  result = sum + (-static_cast<uint64_t>(sum < result) & kEpsilon);
+  return result - (-static_cast<uint64_t>(result >= kModulus) & kModulus);
+}
+
+uint64_t Power(uint64_t base, uint64_t exponent) {
+  uint64_t result = 1;
+  while (exponent > 0) {
+    if (exponent & 1) {
+      result = Multiply(result, base);
+    }
+    base = Multiply(base, base);
+    exponent >>= 1;
+  }
+  return result;
+}
+
+// Cooley-Tukey transform of a fixed power-of-two length. The inverse
+// transform is not divided by the length, which only scales the result
+class NumberTheoreticTransform {
+ public:
+  NumberTheoreticTransform() = default;
+
+  explicit NumberTheoreticTransform(size_t size)
+      : roots_(size / 2), inverse_roots_(size / 2), reversed_(size, 0) {
+    size_t bits = 0;
+    while ((size_t(1) << bits) < size) {
+      ++bits;
+    }
+    for (size_t index = 1; index < size; ++index) {
+      reversed_[index] = static_cast<uint32_t>(
+          (reversed_[index >> 1] >> 1) | ((index & 1) << (bits - 1)));
+    }
+
+    const uint64_t root = Power(kGenerator, (kModulus - 1) / size);
+    const uint64_t inverse_root = Power(root, kModulus - 2);
+    uint64_t power = 1;
+    uint64_t inverse_power = 1;
+    for (size_t index = 0; index < size / 2; ++index) {
+      roots_[index] = power;
+      inverse_roots_[index] = inverse_power;
+      power = Multiply(power, root);
+      inverse_power = Multiply(inverse_power, inverse_root);
+    }
+  }
+
+  size_t Size() const { return reversed_.size(); }
+
+  void Forward(uint64_t *values) const { Transform(values, roots_); }
+
+  void Inverse(uint64_t *values) const { Transform(values, inverse_roots_); }
+
+ private:
+  void Transform(uint64_t *values, const std::vector<uint64_t> &roots) const {
+    const size_t size = Size();
+    for (size_t index = 0; index < size; ++index) {
+      if (index < reversed_[index]) {
+        std::swap(values[index], values[reversed_[index]]);
+      }
+    }
+    for (size_t length = 2; length <= size; length *= 2) {
+      const size_t half = length / 2;
+      const size_t stride = size / length;
+      for (size_t begin = 0; begin < size; begin += length) {
+        for (size_t index = 0; index < half; ++index) {
+          const uint64_t even = values[begin + index];
+          const uint64_t odd =
+              Multiply(values[begin + index + half], roots[index * stride]);
+          values[begin + index] = Add(even, odd);
+          values[begin + index + half] = Subtract(even, odd);
+        }
+      }
+    }
+  }
+
+  // Powers of the primitive root of unity of order Size()
+  std::vector<uint64_t> roots_;
+  std::vector<uint64_t> inverse_roots_;
+  std::vector<uint32_t> reversed_;
+};
+
+}  // namespace ntt
+
+// Computes sum over j of p_j * (p_j - t_j)^2 for every alignment, where
+// a wildcard is zero and a character is its code plus one. The text has no
+// wildcards, so the classic p_j * t_j * (p_j - t_j)^2 needs no factor t_j.
+// Each term is nonnegative, so the sum vanishes exactly at matches, and it
+// is less than |pattern| * 2^24, so its residue modulo ntt::kModulus is zero
+// only then. Expanded, the sum is a constant and two correlations, which are
+// computed with transforms over text windows in O(log |pattern|) per byte,
+// however many fragments of the pattern occur in the text
+class NttWildcardMatcher {
+ public:
+  NttWildcardMatcher() : pattern_length_(0), pending_offset_(0) {}
+
+  // Window of text processed by one transform
+  static size_t WindowLength(size_t pattern_length) {
+    constexpr size_t kMinWindowLength = 1 << 12;
+    size_t window_length = kMinWindowLength;
+    while (window_length < 4 * pattern_length) {
+      window_length *= 2;
+    }
+    return window_length;
+  }
+
+  void Init(const std::string &pattern, char wildcard) {
+    pattern_length_ = pattern.length();
+    const size_t window_length = WindowLength(pattern_length_);
+
+    auto spectra = std::make_shared<PatternSpectra>();
+    spectra->transform = ntt::NumberTheoreticTransform(window_length);
+    spectra->values.assign(window_length, 0);
+    spectra->squares.assign(window_length, 0);
+    uint64_t sum_of_cubes = 0;
+    // Reversing the pattern turns correlations into convolutions
+    for (size_t index = 0; index < pattern_length_; ++index) {
+      const char symbol = pattern[pattern_length_ - 1 - index];
+      const uint64_t value = (symbol == wildcard) ? 0 : Value(symbol);
+      spectra->values[index] = value;
+      spectra->squares[index] = value * value;
+      sum_of_cubes = ntt::Add(sum_of_cubes, value * value * value);
+    }
+    spectra->transform.Forward(spectra->values.data());
+    spectra->transform.Forward(spectra->squares.data());
+    // The inverse transform is not divided by the window length,
+    // so the correlations come out multiplied by it
+    spectra->matching_residue = ntt::Subtract(
+        0, ntt::Multiply(window_length % ntt::kModulus, sum_of_cubes));
+    spectra_ = std::move(spectra);
+
+    text_values_.assign(window_length, 0);
+    text_squares_.assign(window_length, 0);
+    Reset();
+  }
+
+  // Resets matcher to start scanning new stream
+  void Reset() {
+    pending_text_.clear();
+    pending_offset_ = 0;
+  }
+
+  // Same contract as WildcardMatcher::ScanBlock, except that a window is
+  // transformed only once it is full: the alignments of the last,
+  // incomplete window are held back until more text comes or Flush is
+  // called. So a call may write more or fewer offsets than |size|,
+  // and the cost per byte does not depend on the block size
+  template <class OutputIterator>
+  OutputIterator ScanBlock(const char *data, size_t size, OutputIterator out) {
+    const size_t window_length = spectra_->transform.Size();
+    const size_t length = pending_text_.size() + size;
+    if (length < window_length) {
+      pending_text_.append(data, size);
+      return out;
+    }
+    const auto at = [this, data](size_t index) {
+      return (index < pending_text_.size()) ?
+          pending_text_[index] :
+          data[index - pending_text_.size()];
+    };
+
+    const size_t step = window_length + 1 - pattern_length_;
+    size_t begin = 0;
+    for (; begin + window_length <= length; begin += step) {
+      out = ScanWindow(at, begin, window_length, pending_offset_ + begin, out);
+    }
+
+    // Alignments from begin on are not scanned yet
+    std::string pending_text(length - begin, 0);
+    for (size_t index = 0; index < pending_text.size(); ++index) {
+      pending_text[index] = at(begin + index);
+    }
+    pending_text_.swap(pending_text);
+    pending_offset_ += begin;
+    return out;
+  }
+
+  // Writes the offsets of the matches held back by ScanBlock, so that
+  // every match ending within the scanned text is reported.
+  // Scanning may go on afterwards
+  template <class OutputIterator>
+  OutputIterator Flush(OutputIterator out) {
+    if (pattern_length_ == 0 || pending_text_.size() < pattern_length_) {
+      return out;
+    }
+    const auto at = [this](size_t index) { return pending_text_[index]; };
+    out = ScanWindow(at, 0, pending_text_.size(), pending_offset_, out);
+    // Only the alignments that need more text stay pending
+    const size_t scanned_length = pending_text_.size() + 1 - pattern_length_;
+    pending_text_.erase(0, scanned_length);
+    pending_offset_ += scanned_length;
+    return out;
+  }
+
+ private:
+  struct PatternSpectra {
+    ntt::NumberTheoreticTransform transform;
+    std::vector<uint64_t> values;
+    std::vector<uint64_t> squares;
+    // Correlations at a match sum up to it
+    uint64_t matching_residue;
+  };
+
+  static uint64_t Value(char symbol) {
+    return static_cast<unsigned char>(symbol) + 1;
+  }
+
+  // Cyclic convolution of the window with the reversed pattern is exact
+  // at positions from |pattern| - 1 to |window| - 1, which correspond
+  // to all the alignments within the window
+  template <class Accessor, class OutputIterator>
+  OutputIterator ScanWindow(const Accessor &at, size_t begin, size_t length,
+                            size_t offset, OutputIterator out) {
+    const auto &transform = spectra_->transform;
+    std::fill(text_values_.begin() + length, text_values_.end(), 0);
+    std::fill(text_squares_.begin() + length, text_squares_.end(), 0);
+    for (size_t index = 0; index < length; ++index) {
+      const uint64_t value = Value(at(begin + index));
+      text_values_[index] = value;
+      text_squares_[index] = value * value;
+    }
+    transform.Forward(text_values_.data());
+    transform.Forward(text_squares_.data());
+
+    for (size_t index = 0; index < transform.Size(); ++index) {
+      const uint64_t cross_term =
+          ntt::Multiply(text_values_[index], spectra_->squares[index]);
+      text_values_[index] = ntt::Subtract(
+          ntt::Multiply(text_squares_[index], spectra_->values[index]),
+          ntt::Add(cross_term, cross_term));
+    }
+    transform.Inverse(text_values_.data());
+
+    for (size_t alignment = 0; alignment + pattern_length_ <= length;
+         ++alignment) {
+      if (text_values_[alignment + pattern_length_ - 1] ==
+          spectra_->matching_residue) {
+        *out++ = offset + alignment;
+      }
+    }
+    return out;
+  }
+
+  size_t pattern_length_;
+  // Copies of a matcher share the transformed pattern
+  std::shared_ptr<const PatternSpectra> spectra_;
+  std::vector<uint64_t> text_values_;
+  std::vector<uint64_t> text_squares_;
+  // Text starting at the first alignment not scanned yet,
+  // which lies at pending_offset_ in the stream
+  std::string pending_text_;
+  size_t pending_offset_;
+};
+
+enum class MatchingEngine { kShiftAnd, kAhoCorasick, kNtt };
+
+// Compares the estimated costs per byte in nanoseconds, taken from
+// --benchmark. Aho-Corasick pays for every fragment occurrence, which are
+// estimated for a text drawn uniformly from the characters of the pattern
+MatchingEngine ChooseMatchingEngine(const std::string &pattern,
+                                    char wildcard) {
+  constexpr double kAhoCorasickStep = 25;
+  constexpr double kCounterIncrement = 2;
+  constexpr double kButterfly = 9;
+
+  if (ShiftAndMatcher::Supports(pattern)) {
+    return MatchingEngine::kShiftAnd;
+  }
+
+  std::vector<bool> occurs(aho_corasick::kAlphabetSize, false);
+  for (const char symbol : pattern) {
+    if (symbol != wildcard) {
+      occurs[static_cast<unsigned char>(symbol)] = true;
+    }
+  }
+  const double alphabet_size = std::max<size_t>(
+      1, std::count(occurs.begin(), occurs.end(), true));
+
+  double fragment_occurrences = 0;
+  for (const auto &fragment : Split(pattern, [wildcard](char symbol) {
+         return symbol == wildcard;
+       })) {
+    if (!fragment.empty()) {
+      fragment_occurrences += std::pow(alphabet_size, -double(fragment.size()));
+    }
+  }
+  const double aho_corasick_cost =
+      kAhoCorasickStep + kCounterIncrement * fragment_occurrences;
+
+  // Three transforms of a window yield |window| + 1 - |pattern| alignments
+  const double window_length =
+      NttWildcardMatcher::WindowLength(pattern.length());
+  const double ntt_cost = kButterfly * 3 * window_length / 2 *
+                          std::log2(window_length) /
+                          (window_length + 1 - pattern.length());
+
+  return (ntt_cost < aho_corasick_cost) ? MatchingEngine::kNtt :
+                                          MatchingEngine::kAhoCorasick;
+}
+
+std::string ReadString(std::istream &input_stream) {
+  std::string input_string;
+  input_stream >> input_string;
+  return input_string;
+}
+
+// Returns positions of the first character of every match
+template <class Matcher>
+std::vector<size_t> FindFuzzyMatchesWith(
+    const std::string &pattern_with_wildcards, const std::string &text,
+    char wildcard) {
+  Matcher matcher;
+  matcher.Init(pattern_with_wildcards, wildcard);
+  std::vector<size_t> occurrences;
+  matcher.Flush(matcher.ScanBlock(text.data(), text.size(),
+                                  std::back_inserter(occurrences)));
+  return occurrences;
+}
+
+std::vector<size_t> FindFuzzyMatches(const std::string &pattern_with_wildcards,
+                                     const std::string &text, char wildcard) {
+  switch (ChooseMatchingEngine(pattern_with_wildcards, wildcard)) {
+    case MatchingEngine::kShiftAnd:
+      return FindFuzzyMatchesWith<ShiftAndMatcher>(pattern_with_wildcards,
+                                                   text, wildcard);
+    case MatchingEngine::kNtt:
+      return FindFuzzyMatchesWith<NttWildcardMatcher>(pattern_with_wildcards,
+                                                      text, wildcard);
+    default:
+      return FindFuzzyMatchesWith<WildcardMatcher>(pattern_with_wildcards,
+                                                   text, wildcard);
+  }
+}
+
+// Returns positions of the first character of every match,
+// separately for each pattern
+std::vector<std::vector<size_t>> FindFuzzyMatchesOfPatterns(
+    const std::vector<std::string> &patterns, const std::string &text,
+    char wildcard) {
+  MultiWildcardMatcher matcher;
+  matcher.Init(patterns, wildcard);
+  std::vector<std::pair<size_t, size_t>> matches;
+  matcher.ScanBlock(text.data(), text.size(), std::back_inserter(matches));
+  std::vector<std::vector<size_t>> occurrences(patterns.size());
+  for (const auto &match : matches) {
+    occurrences[match.first].push_back(match.second);
+  }
+  for (auto &pattern_occurrences : occurrences) {
+    std::sort(pattern_occurrences.begin(), pattern_occurrences.end());
+  }
+  return occurrences;
+}
+
+// Chunks overlap by |pattern| - 1 characters, so every match is found
+// exactly once: in the chunk where its first character lies.
+// Calls scan_chunk(chunk, chunk_matcher, chunk_begin, chunk_end)
+// for every chunk in a thread of its own
+template <class Matcher, class ChunkScanner>
+void ScanChunksInParallel(const Matcher &matcher, size_t pattern_length,
+                          size_t text_length, size_t number_of_chunks,
+                          ChunkScanner scan_chunk) {
+  const size_t chunk_length =
+      (text_length + number_of_chunks - 1) / number_of_chunks;
+  const size_t overlap = (pattern_length == 0) ? 0 : pattern_length - 1;
+  RunInParallel(
+      number_of_chunks,
+      [&](size_t chunk) {
+        const size_t chunk_begin = std::min(text_length, chunk * chunk_length);
+        const size_t chunk_end =
+            std::min(text_length, chunk_begin + chunk_length + overlap);
+        Matcher chunk_matcher = matcher;
+        scan_chunk(chunk, &chunk_matcher, chunk_begin, chunk_end);
+      });
+}
+
+// Smaller chunks are not worth starting a thread
+size_t NumberOfChunks(size_t text_length, size_t number_of_threads) {
+  constexpr size_t kMinChunkLength = 1 << 16;
+  return std::max<size_t>(
+      1, std::min(number_of_threads, text_length / kMinChunkLength));
+}
+
+template <class Matcher>
+std::vector<size_t> FindFuzzyMatchesParallelWith(
+    const std::string &pattern_with_wildcards, const std::string &text,
+    char wildcard, size_t number_of_threads) {
+  Matcher matcher;
+  matcher.Init(pattern_with_wildcards, wildcard);
+
+  const size_t number_of_chunks = NumberOfChunks(text.size(),
+                                                 number_of_threads);
+  std::vector<std::vector<size_t>> occurrences_by_chunk(number_of_chunks);
+  ScanChunksInParallel(
+      matcher, pattern_with_wildcards.size(), text.size(), number_of_chunks,
+      [&](size_t chunk, Matcher *chunk_matcher, size_t chunk_begin,
+          size_t chunk_end) {
+        auto &occurrences = occurrences_by_chunk[chunk];
+        chunk_matcher->Flush(chunk_matcher->ScanBlock(
+            text.data() + chunk_begin, chunk_end - chunk_begin,
+            std::back_inserter(occurrences)));
+        for (auto &occurrence : occurrences) {
+          occurrence += chunk_begin;
+        }
+      });
+
+  std::vector<size_t> occurrences;
+  for (const auto &chunk_occurrences : occurrences_by_chunk) {
+    occurrences.insert(occurrences.end(), chunk_occurrences.begin(),
+                       chunk_occurrences.end());
+  }
+  return occurrences;
+}
+
+std::vector<size_t> FindFuzzyMatchesParallel(
+    const std::string &pattern_with_wildcards, const std::string &text,
+    char wildcard, size_t number_of_threads = DefaultNumberOfThreads()) {
+  switch (ChooseMatchingEngine(pattern_with_wildcards, wildcard)) {
+    case MatchingEngine::kShiftAnd:
+      return FindFuzzyMatchesParallelWith<ShiftAndMatcher>(
+          pattern_with_wildcards, text, wildcard, number_of_threads);
+    case MatchingEngine::kNtt:
+      return FindFuzzyMatchesParallelWith<NttWildcardMatcher>(
+          pattern_with_wildcards, text, wildcard, number_of_threads);
+    default:
+      return FindFuzzyMatchesParallelWith<WildcardMatcher>(
+          pattern_with_wildcards, text, wildcard, number_of_threads);
+  }
+}
+
+
+// Output iterator which only counts the positions written to it
+class CountingIterator {
+ public:
+  CountingIterator() : count_(0) {}
+
+  CountingIterator &operator*() { return *this; }
+  CountingIterator &operator++() { return *this; }
+  CountingIterator &operator++(int) { return *this; }
+
+  CountingIterator &operator=(size_t /*position*/) {
+    ++count_;
+    return *this;
+  }
+
+  size_t Count() const { return count_; }
+
+ private:
+  size_t count_;
+};
+
+// Matches are counted in every chunk and the counts are summed,
+// no position is stored
+template <class Matcher>
+size_t CountFuzzyMatchesWith(const std::string &pattern_with_wildcards,
+                             const std::string &text, char wildcard,
+                             size_t number_of_threads) {
+  Matcher matcher;
+  matcher.Init(pattern_with_wildcards, wildcard);
+
+  const size_t number_of_chunks = NumberOfChunks(text.size(),
+                                                 number_of_threads);
+  std::vector<size_t> counts_by_chunk(number_of_chunks);
+  ScanChunksInParallel(
+      matcher, pattern_with_wildcards.size(), text.size(), number_of_chunks,
+      [&](size_t chunk, Matcher *chunk_matcher, size_t chunk_begin,
+          size_t chunk_end) {
+        counts_by_chunk[chunk] =
+            chunk_matcher
+                ->Flush(chunk_matcher->ScanBlock(text.data() + chunk_begin,
+                                                 chunk_end - chunk_begin,
+                                                 CountingIterator()))
+                .Count();
+      });
+  return std::accumulate(counts_by_chunk.begin(), counts_by_chunk.end(),
+                         size_t(0));
+}
+
+size_t CountFuzzyMatches(const std::string &pattern_with_wildcards,
+                         const std::string &text, char wildcard,
+                         size_t number_of_threads = DefaultNumberOfThreads()) {
+  switch (ChooseMatchingEngine(pattern_with_wildcards, wildcard)) {
+    case MatchingEngine::kShiftAnd:
+      return CountFuzzyMatchesWith<ShiftAndMatcher>(
+          pattern_with_wildcards, text, wildcard, number_of_threads);
+    case MatchingEngine::kNtt:
+      return CountFuzzyMatchesWith<NttWildcardMatcher>(
+          pattern_with_wildcards, text, wildcard, number_of_threads);
+    default:
+      return CountFuzzyMatchesWith<WildcardMatcher>(
+          pattern_with_wildcards, text, wildcard, number_of_threads);
+  }
+}
+
+// Length of the blocks in which FindFirstFuzzyMatchesWith scans the text
+template <class Matcher>
+size_t FirstMatchesBlockSize(size_t /*pattern_length*/) {
+  return 1 << 12;
+}
+
+// NttWildcardMatcher reports nothing until a window is full,
+// so a block covers a whole window
+template <>
+size_t FirstMatchesBlockSize<NttWildcardMatcher>(size_t pattern_length) {
+  return std::max<size_t>(1 << 12,
+                          NttWildcardMatcher::WindowLength(pattern_length));
+}
+
+// The text is scanned block by block, and the scan stops after the block
+// where the number of matches reaches max_number_of_matches
+template <class Matcher>
+std::vector<size_t> FindFirstFuzzyMatchesWith(
+    const std::string &pattern_with_wildcards, const std::string &text,
+    char wildcard, size_t max_number_of_matches) {
+  const size_t block_size =
+      FirstMatchesBlockSize<Matcher>(pattern_with_wildcards.length());
+
+  Matcher matcher;
+  matcher.Init(pattern_with_wildcards, wildcard);
+  std::vector<size_t> occurrences;
+  for (size_t block_begin = 0;
+       block_begin < text.size() &&
+       occurrences.size() < max_number_of_matches;
+       block_begin += block_size) {
+    matcher.ScanBlock(text.data() + block_begin,
+                      std::min(block_size, text.size() - block_begin),
+                      std::back_inserter(occurrences));
+  }
+  if (occurrences.size() < max_number_of_matches) {
+    matcher.Flush(std::back_inserter(occurrences));
+  }
+  if (occurrences.size() > max_number_of_matches) {
+    occurrences.resize(max_number_of_matches);
+  }
+  return occurrences;
+}
+
+// Returns positions of the first character of at most
+// max_number_of_matches leftmost matches
+std::vector<size_t> FindFirstFuzzyMatches(
+    const std::string &pattern_with_wildcards, const std::string &text,
+    char wildcard, size_t max_number_of_matches) {
+  switch (ChooseMatchingEngine(pattern_with_wildcards, wildcard)) {
+    case MatchingEngine::kShiftAnd:
+      return FindFirstFuzzyMatchesWith<ShiftAndMatcher>(
+          pattern_with_wildcards, text, wildcard, max_number_of_matches);
+    case MatchingEngine::kNtt:
+      return FindFirstFuzzyMatchesWith<NttWildcardMatcher>(
+          pattern_with_wildcards, text, wildcard, max_number_of_matches);
+    default:
+      return FindFirstFuzzyMatchesWith<WildcardMatcher>(
+          pattern_with_wildcards, text, wildcard, max_number_of_matches);
+  }
+}
+
+bool HasFuzzyMatch(const std::string &pattern_with_wildcards,
+                   const std::string &text, char wildcard) {
+  return !FindFirstFuzzyMatches(pattern_with_wildcards, text, wildcard, 1)
+              .empty();
+}
+
+const size_t kStreamBlockSize = 1 << 16;
+
+// Sources of text blocks for the streaming scan. NextBlock returns
+// an empty range once the input is exhausted, blocks are never longer
+// than kStreamBlockSize and stay valid until the next call
+class StreamBlockSource {
+ public:
+  explicit StreamBlockSource(std::istream *input_stream)
+      : input_stream_(input_stream), buffer_(kStreamBlockSize) {}
+
+  IteratorRange<const char *> NextBlock() {
+    input_stream_->read(buffer_.data(), buffer_.size());
+    return {buffer_.data(), buffer_.data() + input_stream_->gcount()};
+  }
+
+ private:
+  std::istream *input_stream_;
+  std::vector<char> buffer_;
+};
+
+class MappedBlockSource {
+ public:
+  explicit MappedBlockSource(const MappedFile &file)
+      : position_(file.Data()), end_(file.Data() + file.Size()) {
+    file.AdviseSequential();
+  }
+
+  IteratorRange<const char *> NextBlock() {
+    const char *begin = position_;
+    position_ += std::min<size_t>(kStreamBlockSize, end_ - position_);
+    return {begin, position_};
+  }
+
+ private:
+  const char *position_;
+  const char *end_;
+};
+
+// Scans the first whitespace-delimited word of the source block by block,
+// so memory does not depend on the length of the text. Positions are
+// written as soon as the matcher reports them, which is after the block
+// containing the end of the match is scanned, or at the end of the text
+// for the matches a matcher holds back. Returns the number of matches
+template <class Matcher, class BlockSource>
+size_t StreamFuzzyMatchesWith(const std::string &pattern_with_wildcards,
+                              char wildcard, BlockSource *source,
+                              std::ostream &output_stream) {
+  const auto is_space = [](char symbol) {
+    return std::isspace(static_cast<unsigned char>(symbol)) != 0;
+  };
+
+  Matcher matcher;
+  matcher.Init(pattern_with_wildcards, wildcard);
+  std::vector<size_t> occurrences;
+  size_t number_of_matches = 0;
+  const auto write_occurrences = [&occurrences, &number_of_matches,
+                                  &output_stream]() {
+    for (const size_t occurrence : occurrences) {
+      output_stream << occurrence << " ";
+    }
+    number_of_matches += occurrences.size();
+    occurrences.clear();
+  };
+  bool text_started = false;
+  for (auto block = source->NextBlock(); block.begin() != block.end();
+       block = source->NextBlock()) {
+    const char *begin = block.begin();
+    if (!text_started) {
+      begin = std::find_if_not(begin, block.end(), is_space);
+      text_started = (begin != block.end());
+    }
+    const char *text_end = std::find_if(begin, block.end(), is_space);
+    matcher.ScanBlock(begin, text_end - begin,
+                      std::back_inserter(occurrences));
+    write_occurrences();
+    if (text_end != block.end()) {
+      break;
+    }
+  }
+  matcher.Flush(std::back_inserter(occurrences));
+  write_occurrences();
+  return number_of_matches;
+}
+
+template <class BlockSource>
+size_t StreamFuzzyMatches(const std::string &pattern_with_wildcards,
+                          char wildcard, BlockSource *source,
+                          std::ostream &output_stream) {
+  switch (ChooseMatchingEngine(pattern_with_wildcards, wildcard)) {
+    case MatchingEngine::kShiftAnd:
+      return StreamFuzzyMatchesWith<ShiftAndMatcher>(
+          pattern_with_wildcards, wildcard, source, output_stream);
+    case MatchingEngine::kNtt:
+      return StreamFuzzyMatchesWith<NttWildcardMatcher>(
+          pattern_with_wildcards, wildcard, source, output_stream);
+    default:
+      return StreamFuzzyMatchesWith<WildcardMatcher>(
+          pattern_with_wildcards, wildcard, source, output_stream);
+  }
+}
+
+
+void Print(const std::vector<size_t> &sequence,
+           std::ostream &output_stream = std::cout) {
+  output_stream << sequence.size() << std::endl;
+
+  for (const auto element : sequence) {
+    output_stream << element << " ";
+  }
+  
+  output_stream << std::endl;
+}
+
+// Every byte of a file is a part of its text. Workers take the next
+// unscanned file from a shared counter, so a worker that got short files
+// takes more of them. Each worker resets its own copy of the matcher,
+// which shares the automaton with the others, for every file.
+// The path and the matches of a file are written as soon as it is
+// scanned, so files appear in the order they are finished.
+// Returns the number of files that could not be read
+template <class Matcher>
+size_t ScanCorpusWith(const std::string &pattern_with_wildcards,
+                      char wildcard, const std::vector<std::string> &paths,
+                      size_t number_of_threads, std::ostream &output_stream) {
+  Matcher matcher;
+  matcher.Init(pattern_with_wildcards, wildcard);
+
+  std::atomic<size_t> next_file(0);
+  std::atomic<size_t> number_of_failures(0);
+  std::mutex output_mutex;
+  RunInParallel(
+      std::max<size_t>(1, std::min(number_of_threads, paths.size())),
+      [&](size_t /*worker*/) {
+        Matcher worker_matcher = matcher;
+        std::vector<size_t> occurrences;
+        std::ostringstream result;
+        for (size_t file = next_file++; file < paths.size();
+             file = next_file++) {
+          result.str("");
+          try {
+            const MappedFile text_file(paths[file]);
+            text_file.AdviseSequential();
+            worker_matcher.Reset();
+            occurrences.clear();
+            worker_matcher.Flush(worker_matcher.ScanBlock(
+                text_file.Data(), text_file.Size(),
+                std::back_inserter(occurrences)));
+            result << paths[file] << std::endl;
+            Print(occurrences, result);
+          } catch (const std::exception &error) {
+            ++number_of_failures;
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cerr << error.what() << std::endl;
+            continue;
+          }
+          std::lock_guard<std::mutex> lock(output_mutex);
+          output_stream << result.str();
+        }
+      });
+  return number_of_failures;
+}
+
+size_t ScanCorpus(const std::string &pattern_with_wildcards, char wildcard,
+                  const std::vector<std::string> &paths,
+                  std::ostream &output_stream,
+                  size_t number_of_threads = DefaultNumberOfThreads()) {
+  switch (ChooseMatchingEngine(pattern_with_wildcards, wildcard)) {
+    case MatchingEngine::kShiftAnd:
+      return ScanCorpusWith<ShiftAndMatcher>(pattern_with_wildcards, wildcard,
+                                             paths, number_of_threads,
+                                             output_stream);
+    case MatchingEngine::kNtt:
+      return ScanCorpusWith<NttWildcardMatcher>(pattern_with_wildcards,
+                                                wildcard, paths,
+                                                number_of_threads,
+                                                output_stream);
+    default:
+      return ScanCorpusWith<WildcardMatcher>(pattern_with_wildcards, wildcard,
+                                             paths, number_of_threads,
+                                             output_stream);
+  }
+}
+
+
+void WriteDictionaryImage(const aho_corasick::AutomatonBuilder &builder,
+                          const std::string &path) {
+  std::ofstream image_stream(path, std::ios::binary);
+  builder.BuildDoubleArray()->Serialize(image_stream);
+  if (!image_stream.flush()) {
+    throw std::runtime_error("failed to write " + path);
+  }
+}
+
+// Words of the dictionary are whitespace separated,
+// the id of a word is its index
+void WriteDictionaryImage(std::istream &input_stream, const std::string &path) {
+  aho_corasick::AutomatonBuilder builder;
+  std::string word;
+  for (size_t id = 0; input_stream >> word; ++id) {
+    builder.Add(word, id);
+  }
+  WriteDictionaryImage(builder, path);
+}
+
+// Words of the pattern file are lines, the id of a word is its index.
+// The words are read right from the mapping of the file
+void WriteDictionaryImage(const MappedFile &pattern_file,
+                          const std::string &path) {
+  aho_corasick::AutomatonBuilder builder;
+  builder.AddLines(pattern_file.Data(), pattern_file.Size());
+  WriteDictionaryImage(builder, path);
+}
+
+// Returns pairs of the position following the last character
+// of a match and the id of the matched word, ordered by position.
+// The text is cut into kNumberOfStreams chunks scanned in lockstep.
+// A chunk starts max_string_length - 1 characters early, so that
+// every match ending within the chunk is found by it
+template <size_t kNumberOfStreams, class Automaton>
+std::vector<std::pair<size_t, size_t>> FindDictionaryMatches(
+    const Automaton &automaton, size_t max_string_length,
+    const std::string &text) {
+  const size_t chunk_length =
+      (text.size() + kNumberOfStreams - 1) / kNumberOfStreams;
+  const size_t overlap = std::max<size_t>(max_string_length, 1) - 1;
+  std::array<IteratorRange<const char *>, kNumberOfStreams> streams;
+  std::array<size_t, kNumberOfStreams> chunk_begins;
+  std::array<size_t, kNumberOfStreams> stream_begins;
+  for (size_t stream = 0; stream < kNumberOfStreams; ++stream) {
+    chunk_begins[stream] = std::min(text.size(), stream * chunk_length);
+    stream_begins[stream] =
+        chunk_begins[stream] - std::min(chunk_begins[stream], overlap);
+    const size_t chunk_end =
+        std::min(text.size(), chunk_begins[stream] + chunk_length);
+    streams[stream] = {text.data() + stream_begins[stream],
+                       text.data() + chunk_end};
+  }
+
+  std::array<std::vector<std::pair<size_t, size_t>>, kNumberOfStreams>
+      matches_by_stream;
+  aho_corasick::ScanInterleaved(
+      automaton, streams,
+      [&](size_t stream, size_t position, size_t id) {
+        const size_t end = stream_begins[stream] + position;
+        if (end > chunk_begins[stream]) {
+          matches_by_stream[stream].emplace_back(end, id);
+        }
+      });
+
+  std::vector<std::pair<size_t, size_t>> matches;
+  for (const auto &stream_matches : matches_by_stream) {
+    matches.insert(matches.end(), stream_matches.begin(),
+                   stream_matches.end());
+  }
+  return matches;
+}
+
+void Print(const std::vector<std::pair<size_t, size_t>> &pairs) {
+  std::cout << pairs.size() << std::endl;
+  for (const auto &pair : pairs) {
+    std::cout << pair.first << " " << pair.second << std::endl;
+  }
+}
+
+namespace benchmark {
+
+// Every character is one of the first |alphabet_size| lowercase letters
+std::string RandomText(size_t length, size_t alphabet_size,
+                       std::mt19937 *generator) {
+  std::uniform_int_distribution<int> letters(0, alphabet_size - 1);
+  std::string text(length, 0);
+  for (auto &symbol : text) {
+    symbol = static_cast<char>('a' + letters(*generator));
+  }
+  return text;
+}
+
+// Every character is a wildcard with probability wildcard_density
+std::string RandomPattern(size_t length, size_t alphabet_size,
+                          double wildcard_density, char wildcard,
+                          std::mt19937 *generator) {
+  std::string pattern = RandomText(length, alphabet_size, generator);
+  std::bernoulli_distribution is_wildcard(wildcard_density);
+  for (auto &symbol : pattern) {
+    if (is_wildcard(*generator)) {
+      symbol = wildcard;
+    }
+  }
+  return pattern;
+}
+
+template <class Function>
+double MeasureSeconds(Function function) {
+  const auto start = std::chrono::steady_clock::now();
+  function();
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+template <class Matcher>
+void BenchmarkScan(const std::string &engine, const std::string &pattern,
+                   char wildcard, const std::string &text,
+                   std::ostream &output_stream) {
+  Matcher matcher;
+  matcher.Init(pattern, wildcard);
+  std::vector<size_t> occurrences(text.size());
+  size_t number_of_matches = 0;
+  const double seconds = MeasureSeconds([&] {
+    number_of_matches =
+        matcher.Flush(matcher.ScanBlock(text.data(), text.size(),
+                                        occurrences.data())) -
+        occurrences.data();
+  });
+  const auto number_of_wildcards =
+      std::count(pattern.begin(), pattern.end(), wildcard);
+  output_stream << "scan: " << engine << " " << pattern.size() << " "
+                << number_of_wildcards << " " << seconds * 1e9 / text.size()
+                << " " << number_of_matches << std::endl;
+}
+
+// Measures the cost of the matchers per byte of text
+void BenchmarkScan(std::ostream &output_stream) {
+  constexpr char kWildcard = '?';
+  constexpr size_t kTextLength = 1 << 24;
+  constexpr size_t kAlphabetSize = 4;
+  const std::pair<size_t, double> kPatterns[] = {
+      {8, 0.25}, {64, 0.25}, {256, 0.1}, {1000, 0.05}, {1000, 0.5},
+      {4000, 0.5}};
+
+  std::mt19937 generator(2016);
+  const std::string text = RandomText(kTextLength, kAlphabetSize, &generator);
+
+  output_stream
+      << "scan: engine pattern_length wildcards ns_per_byte matches"
+      << std::endl;
+  for (const auto &pattern_parameters : kPatterns) {
+    const std::string pattern = RandomPattern(
+        pattern_parameters.first, kAlphabetSize, pattern_parameters.second,
+        kWildcard, &generator);
+    BenchmarkScan<WildcardMatcher>("aho_corasick", pattern, kWildcard, text,
+                                   output_stream);
+    if (ShiftAndMatcher::Supports(pattern)) {
+      BenchmarkScan<ShiftAndMatcher>("shift_and", pattern, kWildcard, text,
+                                     output_stream);
+    }
+    BenchmarkScan<NttWildcardMatcher>("ntt", pattern, kWildcard, text,
+                                      output_stream);
+  }
+}
+
+
+// Letters are drawn with their estimated frequencies in English
+std::string RandomEnglishText(size_t length, std::mt19937 *generator) {
+  std::vector<double> weights;
+  for (char letter = 'a'; letter <= 'z'; ++letter) {
+    weights.push_back(EstimatedByteFrequency(letter));
+  }
+  std::discrete_distribution<int> letters(weights.begin(), weights.end());
+  std::string text(length, 0);
+  for (auto &symbol : text) {
+    symbol = static_cast<char>('a' + letters(*generator));
+  }
+  return text;
+}
+
+// Words are substrings of the text, so that the dictionary
+// resembles the text it is matched against
+std::vector<std::string> RandomDictionary(const std::string &text,
+                                          size_t number_of_words,
+                                          size_t min_length, size_t max_length,
+                                          std::mt19937 *generator) {
+  std::uniform_int_distribution<size_t> lengths(min_length, max_length);
+  std::uniform_int_distribution<size_t> starts(0, text.size() - max_length);
+  std::vector<std::string> words;
+  words.reserve(number_of_words);
+  for (size_t index = 0; index < number_of_words; ++index) {
+    words.push_back(text.substr(starts(*generator), lengths(*generator)));
+  }
+  return words;
+}
+
+template <class Automaton>
+std::string SizeInBytes(const Automaton &automaton) {
+  return std::to_string(automaton.SizeInBytes());
+}
+
+// Memory of the map-based automaton is scattered over the heap
+std::string SizeInBytes(const aho_corasick::Automaton &) {
+  return "-";
+}
+
+template <class AutomatonPointer>
+void BenchmarkDictionaryBackend(
+    const std::string &backend, const std::string &kind,
+    const aho_corasick::AutomatonBuilder &builder, size_t number_of_words,
+    size_t max_word_length, const std::string &text,
+    std::ostream &output_stream,
+    AutomatonPointer (aho_corasick::AutomatonBuilder::*build)() const) {
+  AutomatonPointer automaton;
+  const double build_seconds =
+      MeasureSeconds([&] { automaton = (builder.*build)(); });
+  size_t number_of_matches = 0;
+  const double scan_seconds = MeasureSeconds([&] {
+    number_of_matches =
+        FindDictionaryMatches<1>(*automaton, max_word_length, text).size();
+  });
+  output_stream << "dictionary: " << kind << " " << number_of_words << " "
+                << backend << " " << SizeInBytes(*automaton) << " "
+                << build_seconds << " " << scan_seconds * 1e9 / text.size()
+                << " " << number_of_matches << std::endl;
+
+  constexpr size_t kNumberOfStreams = 4;
+  size_t number_of_interleaved_matches = 0;
+  const double interleaved_scan_seconds = MeasureSeconds([&] {
+    number_of_interleaved_matches =
+        FindDictionaryMatches<kNumberOfStreams>(*automaton, max_word_length,
+                                                text).size();
+  });
+  output_stream << "dictionary: " << kind << " " << number_of_words << " "
+                << backend << "_x" << kNumberOfStreams << " "
+                << SizeInBytes(*automaton) << " " << build_seconds << " "
+                << interleaved_scan_seconds * 1e9 / text.size() << " "
+                << number_of_interleaved_matches << std::endl;
+}
+
+// Compares the backends of the Aho-Corasick automaton on large
+// dictionaries. The map-based automaton completes the transitions
+// of every node in advance, which does not fit in memory for the largest
+// dictionaries, so it is measured on the smaller ones only
+void BenchmarkDictionary(std::ostream &output_stream) {
+  constexpr size_t kTextLength = 1 << 22;
+  constexpr size_t kCorpusLength = 1 << 24;
+  constexpr size_t kMapBasedLimit = 1 << 17;
+  constexpr size_t kMinWordLength = 4;
+  constexpr size_t kMaxWordLength = 16;
+  const size_t kNumbersOfWords[] = {1 << 17, 1 << 20};
+
+  std::mt19937 generator(2016);
+  output_stream << "dictionary: kind words backend bytes build_seconds "
+                   "ns_per_byte matches"
+                << std::endl;
+  for (const std::string kind : {"english", "random"}) {
+    const std::string corpus = (kind == "english") ?
+        RandomEnglishText(kCorpusLength, &generator) :
+        RandomText(kCorpusLength, 26, &generator);
+    const std::string text = corpus.substr(0, kTextLength);
+    for (const size_t number_of_words : kNumbersOfWords) {
+      const auto words =
+          RandomDictionary(corpus, number_of_words, kMinWordLength,
+                           kMaxWordLength, &generator);
+      aho_corasick::AutomatonBuilder builder;
+      for (size_t index = 0; index < words.size(); ++index) {
+        builder.Add(words[index], index);
+      }
+      using aho_corasick::AutomatonBuilder;
+      if (number_of_words <= kMapBasedLimit) {
+        BenchmarkDictionaryBackend("map", kind, builder, number_of_words,
+                                   kMaxWordLength, text, output_stream,
+                                   &AutomatonBuilder::Build);
+      }
+      BenchmarkDictionaryBackend("arena", kind, builder, number_of_words,
+                                 kMaxWordLength, text, output_stream,
+                                 &AutomatonBuilder::BuildArena);
+      BenchmarkDictionaryBackend("dense", kind, builder, number_of_words,
+                                 kMaxWordLength, text, output_stream,
+                                 &AutomatonBuilder::BuildDense);
+      BenchmarkDictionaryBackend("double_array", kind, builder,
+                                 number_of_words, kMaxWordLength, text,
+                                 output_stream,
+                                 &AutomatonBuilder::BuildDoubleArray);
+    }
+  }
+}
+
+// Compares adding words one by one to rebuilding the whole dictionary.
+// The longest addition is the longest stall a scan would see
+void BenchmarkIncremental(std::ostream &output_stream) {
+  constexpr size_t kNumberOfWords = 1 << 17;
+  std::mt19937 generator(2016);
+  const std::string corpus = RandomEnglishText(1 << 22, &generator);
+  const auto words =
+      RandomDictionary(corpus, kNumberOfWords, 4, 16, &generator);
+
+  aho_corasick::IncrementalAutomaton incremental_automaton;
+  double longest_addition_seconds = 0;
+  const double total_seconds = MeasureSeconds([&] {
+    for (size_t index = 0; index < words.size(); ++index) {
+      longest_addition_seconds = std::max(
+          longest_addition_seconds, MeasureSeconds([&] {
+            incremental_automaton.Add(words[index], index);
+          }));
+    }
+  });
+
+  aho_corasick::AutomatonBuilder builder;
+  for (size_t index = 0; index < words.size(); ++index) {
+    builder.Add(words[index], index);
+  }
+  const double rebuild_seconds =
+      MeasureSeconds([&] { builder.BuildDoubleArray(); });
+
+  output_stream << "incremental: words levels average_add_us "
+                   "longest_add_seconds rebuild_seconds"
+                << std::endl;
+  output_stream << "incremental: " << kNumberOfWords << " "
+                << incremental_automaton.NumberOfLevels() << " "
+                << total_seconds * 1e6 / kNumberOfWords << " "
+                << longest_addition_seconds << " " << rebuild_seconds
+                << std::endl;
+}
+
+}  // namespace benchmark
+
+
+// interface_test.cpp includes this file with AHO_CORASICK_NO_MAIN defined
+#ifndef AHO_CORASICK_NO_MAIN
+
+int main(int argc, char *argv[]) {
+#ifdef AHO_CORASICK_STATS
+  std::atexit([] { stats::Dump(std::cerr); });
+#endif
+  if (argc > 1 && std::string(argv[1]) == "--benchmark") {
+    benchmark::BenchmarkScan(std::cout);
+    return 0;
+  }
+  if (argc > 1 && std::string(argv[1]) == "--benchmark-dictionary") {
+    benchmark::BenchmarkDictionary(std::cout);
+    benchmark::BenchmarkIncremental(std::cout);
+    return 0;
+  }
+  // The image is built once and then mapped by every scanning run.
+  // Words are taken from the pattern file if it is given
+  if (argc > 2 && std::string(argv[1]) == "--write-image") {
+    try {
+      if (argc > 3) {
+        const MappedFile pattern_file(argv[3]);
+        WriteDictionaryImage(pattern_file, argv[2]);
+      } else {
+        WriteDictionaryImage(std::cin, argv[2]);
+      }
+    } catch (const std::exception &error) {
+      std::cerr << error.what() << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+  if (argc > 2 && std::string(argv[1]) == "--image") {
+    try {
+      const MappedFile image_file(argv[2]);
+      const aho_corasick::AutomatonImage automaton(image_file.Data(),
+                                                   image_file.Size());
+      constexpr size_t kNumberOfStreams = 4;
+      Print(FindDictionaryMatches<kNumberOfStreams>(
+          automaton, automaton.MaxStringLength(), ReadString(std::cin)));
+    } catch (const std::exception &error) {
+      std::cerr << error.what() << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  constexpr char kWildcard = '?';
+  // Number of patterns, the patterns and the text,
+  // matches are printed for every pattern
+  if (argc > 1 && std::string(argv[1]) == "--multi") {
+    size_t number_of_patterns = 0;
+    std::cin >> number_of_patterns;
+    std::vector<std::string> patterns;
+    for (size_t index = 0; index < number_of_patterns; ++index) {
+      patterns.push_back(ReadString(std::cin));
+    }
+    const std::string text = ReadString(std::cin);
+    for (const auto &occurrences :
+         FindFuzzyMatchesOfPatterns(patterns, text, kWildcard)) {
+      Print(occurrences);
+    }
+    return 0;
+  }
+
+  const std::string pattern_with_wildcards = ReadString(std::cin);
+  // The pattern is followed by the paths of the files to scan
+  if (argc > 1 && std::string(argv[1]) == "--corpus") {
+    std::vector<std::string> paths;
+    for (std::string path; std::cin >> path;) {
+      paths.push_back(path);
+    }
+    return ScanCorpus(pattern_with_wildcards, kWildcard, paths, std::cout) ?
+        1 :
+        0;
+  }
+  // Positions are printed while the text is read,
+  // and their number follows them
+  if (argc > 1 && std::string(argv[1]) == "--stream") {
+    size_t number_of_matches = 0;
+    try {
+      if (argc > 2) {
+        const MappedFile text_file(argv[2]);
+        MappedBlockSource source(text_file);
+        number_of_matches = StreamFuzzyMatches(pattern_with_wildcards,
+                                               kWildcard, &source, std::cout);
+      } else {
+        StreamBlockSource source(&std::cin);
+        number_of_matches = StreamFuzzyMatches(pattern_with_wildcards,
+                                               kWildcard, &source, std::cout);
+      }
+    } catch (const std::exception &error) {
+      std::cerr << error.what() << std::endl;
+      return 1;
+    }
+    std::cout << std::endl << number_of_matches << std::endl;
+    return 0;
+  }
+  const std::string text = ReadString(std::cin);
+  // Only the number of matches or whether there is one is printed
+  if (argc > 1 && std::string(argv[1]) == "--count") {
+    std::cout << CountFuzzyMatches(pattern_with_wildcards, text, kWildcard)
+              << std::endl;
+    return 0;
+  }
+  if (argc > 1 && std::string(argv[1]) == "--exists") {
+    std::cout << HasFuzzyMatch(pattern_with_wildcards, text, kWildcard)
+              << std::endl;
+    return 0;
+  }
+  if (argc > 2 && std::string(argv[1]) == "--first") {
+    const std::string argument = argv[2];
+    size_t max_number_of_matches = 0;
+    try {
+      if (argument.empty() ||
+          argument.find_first_not_of("0123456789") != std::string::npos) {
+        throw std::invalid_argument("not a number");
+      }
+      max_number_of_matches = std::stoul(argument);
+    } catch (const std::logic_error &) {
+      std::cerr << "--first expects a number of matches, got '" << argument
+                << "'" << std::endl;
+      return 1;
+    }
+    Print(FindFirstFuzzyMatches(pattern_with_wildcards, text, kWildcard,
+                                max_number_of_matches));
+    return 0;
+  }
+  Print(FindFuzzyMatchesParallel(pattern_with_wildcards, text, kWildcard));
   return 0;
 }
 
+#endif  // AHO_CORASICK_NO_MAIN
@@ -0,0 +1,795 @@
+// Compares the matchers and the automata of interface.cpp with brute force
+// on random inputs. Exits with a nonzero status on the first mismatch.
+//
+//     g++ -std=c++11 -O2 -Wall -pthread -o interface_test interface_test.cpp
+//     ./interface_test
+
+#define AHO_CORASICK_NO_MAIN
+#include "interface.cpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+
+const char kWildcard = '?';
+
+// Reports the failed check and stops the test
+void Expect(bool condition, const std::string &what) {
+  if (!condition) {
+    std::cerr << "FAILED: " << what << std::endl;
+    std::exit(1);
+  }
+}
+
+std::string RandomString(size_t length, size_t alphabet_size,
+                         std::mt19937 *generator) {
+  std::string string;
+  for (size_t index = 0; index < length; ++index) {
+    string.push_back('a' + (*generator)() % alphabet_size);
+  }
+  return string;
+}
+
+std::string RandomPattern(size_t length, size_t alphabet_size,
+                          size_t wildcard_period, std::mt19937 *generator) {
+  std::string pattern = RandomString(length, alphabet_size, generator);
+  for (auto &symbol : pattern) {
+    if ((*generator)() % wildcard_period == 0) {
+      symbol = kWildcard;
+    }
+  }
+  return pattern;
+}
+
+std::vector<size_t> NaiveFuzzyMatches(const std::string &pattern,
+                                      const std::string &text) {
+  std::vector<size_t> occurrences;
+  for (size_t start = 0; start + pattern.size() <= text.size(); ++start) {
+    bool matches = true;
+    for (size_t offset = 0; offset < pattern.size() && matches; ++offset) {
+      matches = pattern[offset] == kWildcard ||
+                pattern[offset] == text[start + offset];
+    }
+    if (matches) {
+      occurrences.push_back(start);
+    }
+  }
+  return occurrences;
+}
+
+// Pairs of the position following a match and the id of the word,
+// ordered by position and then by id
+std::vector<std::pair<size_t, size_t>> NaiveDictionaryMatches(
+    const std::vector<std::string> &words, const std::string &text) {
+  std::vector<std::pair<size_t, size_t>> matches;
+  for (size_t end = 1; end <= text.size(); ++end) {
+    for (size_t id = 0; id < words.size(); ++id) {
+      const std::string &word = words[id];
+      if (word.size() <= end &&
+          text.compare(end - word.size(), word.size(), word) == 0) {
+        matches.emplace_back(end, id);
+      }
+    }
+  }
+  return matches;
+}
+
+// Matches of the same position may come in any order
+std::vector<std::pair<size_t, size_t>> Sorted(
+    std::vector<std::pair<size_t, size_t>> matches) {
+  std::sort(matches.begin(), matches.end());
+  return matches;
+}
+
+// Positions as the streaming scan writes them
+std::string Joined(const std::vector<size_t> &positions) {
+  std::ostringstream output_stream;
+  for (const size_t position : positions) {
+    output_stream << position << " ";
+  }
+  return output_stream.str();
+}
+
+// Directory for the files of one test, removed with everything in it
+class TemporaryDirectory {
+ public:
+  TemporaryDirectory() {
+    char path[] = "/tmp/interface_test.XXXXXX";
+    Expect(mkdtemp(path) != nullptr, "mkdtemp");
+    path_ = path;
+  }
+
+  ~TemporaryDirectory() {
+    for (const auto &file : files_) {
+      std::remove(file.c_str());
+    }
+    rmdir(path_.c_str());
+  }
+
+  TemporaryDirectory(const TemporaryDirectory &) = delete;
+  TemporaryDirectory &operator=(const TemporaryDirectory &) = delete;
+
+  // Path of a file in the directory, the file itself is not created
+  std::string File(const std::string &name) {
+    files_.push_back(path_ + "/" + name);
+    return files_.back();
+  }
+
+ private:
+  std::string path_;
+  std::vector<std::string> files_;
+};
+
+template <class NodeReference>
+std::vector<std::pair<size_t, size_t>> ScanByCharacter(
+    NodeReference state, const std::string &text) {
+  std::vector<std::pair<size_t, size_t>> matches;
+  for (size_t index = 0; index < text.size(); ++index) {
+    state = state.Next(text[index]);
+    state.GenerateMatches([&matches, index](size_t id) {
+      matches.emplace_back(index + 1, id);
+    });
+  }
+  return Sorted(matches);
+}
+
+std::vector<std::pair<size_t, size_t>> ScanIncremental(
+    const aho_corasick::IncrementalAutomaton::Cursor &root,
+    const std::string &text) {
+  std::vector<std::pair<size_t, size_t>> matches;
+  auto cursor = root;
+  for (size_t index = 0; index < text.size(); ++index) {
+    cursor.Next(text[index]);
+    cursor.GenerateMatches([&matches, index](size_t id) {
+      matches.emplace_back(index + 1, id);
+    });
+  }
+  return Sorted(matches);
+}
+
+template <class Matcher>
+void CheckMatcher(const std::string &engine, const std::string &pattern,
+                  const std::string &text,
+                  const std::vector<size_t> &expected,
+                  std::mt19937 *generator) {
+  const std::string what = engine + " on pattern " + pattern;
+  Expect(FindFuzzyMatchesWith<Matcher>(pattern, text, kWildcard) == expected,
+         what);
+
+  // Blocks of random lengths from empty up to 4 KiB,
+  // mostly short ones, with matches flushed now and then
+  Matcher matcher;
+  matcher.Init(pattern, kWildcard);
+  std::vector<size_t> occurrences;
+  for (size_t begin = 0; begin < text.size();) {
+    const size_t max_size = size_t(1) << ((*generator)() % 13);
+    const size_t size = std::min<size_t>(text.size() - begin,
+                                         (*generator)() % max_size);
+    matcher.ScanBlock(text.data() + begin, size,
+                      std::back_inserter(occurrences));
+    begin += size;
+    // Scanning goes on after a flush
+    if ((*generator)() % 8 == 0) {
+      matcher.Flush(std::back_inserter(occurrences));
+    }
+  }
+  matcher.Flush(std::back_inserter(occurrences));
+  Expect(occurrences == expected, what + " in blocks");
+
+  for (const size_t number_of_threads : {1, 2, 3}) {
+    Expect(FindFuzzyMatchesParallelWith<Matcher>(pattern, text, kWildcard,
+                                                 number_of_threads) ==
+               expected,
+           what + " in parallel");
+    Expect(CountFuzzyMatchesWith<Matcher>(pattern, text, kWildcard,
+                                          number_of_threads) ==
+               expected.size(),
+           what + " count");
+  }
+  for (const size_t max_number_of_matches : {0, 1, 5, 1 << 20}) {
+    const std::vector<size_t> first_expected(
+        expected.begin(),
+        expected.begin() + std::min<size_t>(max_number_of_matches,
+                                            expected.size()));
+    Expect(FindFirstFuzzyMatchesWith<Matcher>(pattern, text, kWildcard,
+                                              max_number_of_matches) ==
+               first_expected,
+           what + " first matches");
+  }
+}
+
+void TestFuzzyMatches() {
+  std::mt19937 generator(2016);
+  for (size_t iteration = 0; iteration < 200; ++iteration) {
+    const size_t alphabet_size = 1 + generator() % 4;
+    const size_t pattern_length =
+        1 + generator() % ((iteration % 3 == 0) ? 300 : 30);
+    const std::string pattern = RandomPattern(
+        pattern_length, alphabet_size, 2 + generator() % 5, &generator);
+    // Long texts are cut into several chunks by the parallel scans
+    const size_t text_length =
+        (iteration % 20 == 0) ? (1 << 17) + generator() % 1000 :
+                                generator() % 3000;
+    const std::string text =
+        RandomString(text_length, alphabet_size, &generator);
+    const std::vector<size_t> expected = NaiveFuzzyMatches(pattern, text);
+
+    Expect(FindFuzzyMatches(pattern, text, kWildcard) == expected,
+           "FindFuzzyMatches on pattern " + pattern);
+    Expect(HasFuzzyMatch(pattern, text, kWildcard) == !expected.empty(),
+           "HasFuzzyMatch on pattern " + pattern);
+    CheckMatcher<WildcardMatcher>("aho-corasick", pattern, text, expected,
+                                  &generator);
+    CheckMatcher<NttWildcardMatcher>("ntt", pattern, text, expected,
+                                     &generator);
+    if (ShiftAndMatcher::Supports(pattern)) {
+      CheckMatcher<ShiftAndMatcher>("shift-and", pattern, text, expected,
+                                    &generator);
+    }
+
+    WildcardMatcher matcher;
+    matcher.Init(pattern, kWildcard);
+    std::vector<size_t> occurrences;
+    for (size_t index = 0; index < text.size(); ++index) {
+      matcher.Scan(text[index], [&occurrences, index, pattern_length] {
+        occurrences.push_back(index + 1 - pattern_length);
+      });
+    }
+    Expect(occurrences == expected, "Scan by character on " + pattern);
+
+    std::istringstream input_stream(text);
+    StreamBlockSource source(&input_stream);
+    std::ostringstream output_stream;
+    const size_t number_of_matches =
+        StreamFuzzyMatches(pattern, kWildcard, &source, output_stream);
+    Expect(number_of_matches == expected.size() &&
+               output_stream.str() == Joined(expected),
+           "StreamFuzzyMatches on " + pattern);
+  }
+}
+
+// Occurrences of patterns with more than 255 words
+// are counted in wider counters
+void TestManyWords() {
+  std::mt19937 generator(2020);
+  for (const size_t number_of_words : {255, 256, 1000}) {
+    std::string pattern;
+    for (size_t word = 0; word < number_of_words; ++word) {
+      pattern += RandomString(1 + generator() % 3, 2, &generator) + kWildcard;
+    }
+    std::string text;
+    for (size_t copy = 0; copy < 3; ++copy) {
+      text += RandomString(generator() % 1000, 2, &generator);
+      for (const char symbol : pattern) {
+        text.push_back(symbol == kWildcard ?
+                           RandomString(1, 2, &generator)[0] : symbol);
+      }
+    }
+    const std::vector<size_t> expected = NaiveFuzzyMatches(pattern, text);
+    Expect(expected.size() >= 3 &&
+               FindFuzzyMatches(pattern, text, kWildcard) == expected,
+           "FindFuzzyMatches on " + std::to_string(number_of_words) +
+               " words");
+  }
+}
+
+template <class Body>
+double SecondsSpentOn(Body body) {
+  const auto start = std::chrono::steady_clock::now();
+  body();
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// A long pattern is matched with transforms of windows of 128 Ki
+// characters. Looking for the first match must not transform a window
+// per short block, so on a text without matches it costs about as much
+// as counting all of them
+void TestLongNttPattern() {
+  std::mt19937 generator(2024);
+  const std::string pattern = RandomPattern(20000, 2, 2, &generator);
+  Expect(ChooseMatchingEngine(pattern, kWildcard) == MatchingEngine::kNtt,
+         "engine for a long pattern");
+
+  std::string text(1 << 20, 'z');
+  for (const size_t position : {300000, 700000}) {
+    for (size_t offset = 0; offset < pattern.size(); ++offset) {
+      text[position + offset] = (pattern[offset] == kWildcard) ?
+          RandomString(1, 2, &generator)[0] : pattern[offset];
+    }
+  }
+  Expect(FindFirstFuzzyMatches(pattern, text, kWildcard, 1) ==
+             std::vector<size_t>{300000},
+         "first match of a long pattern");
+  Expect(FindFirstFuzzyMatches(pattern, text, kWildcard, 5) ==
+             (std::vector<size_t>{300000, 700000}),
+         "first matches of a long pattern");
+  Expect(HasFuzzyMatch(pattern, text, kWildcard), "long pattern exists");
+
+  const std::string no_match_text(1 << 20, 'z');
+  bool has_match = true;
+  const double exists_seconds = SecondsSpentOn([&] {
+    has_match = HasFuzzyMatch(pattern, no_match_text, kWildcard);
+  });
+  size_t count = 1;
+  const double count_seconds = SecondsSpentOn([&] {
+    count = CountFuzzyMatches(pattern, no_match_text, kWildcard, 1);
+  });
+  Expect(!has_match && count == 0, "long pattern without matches");
+  Expect(exists_seconds < 3 * count_seconds + 0.05,
+         "HasFuzzyMatch took " + std::to_string(exists_seconds) +
+             " s, counting took " + std::to_string(count_seconds) + " s");
+}
+
+void TestMultiplePatterns() {
+  std::mt19937 generator(2017);
+  for (size_t iteration = 0; iteration < 100; ++iteration) {
+    const size_t alphabet_size = 1 + generator() % 4;
+    std::vector<std::string> patterns(1 + generator() % 10);
+    for (auto &pattern : patterns) {
+      pattern = RandomPattern(1 + generator() % 20, alphabet_size,
+                              2 + generator() % 5, &generator);
+    }
+    const std::string text =
+        RandomString(generator() % 2000, alphabet_size, &generator);
+    const auto occurrences =
+        FindFuzzyMatchesOfPatterns(patterns, text, kWildcard);
+    for (size_t index = 0; index < patterns.size(); ++index) {
+      Expect(occurrences[index] == NaiveFuzzyMatches(patterns[index], text),
+             "FindFuzzyMatchesOfPatterns on " + patterns[index]);
+    }
+  }
+}
+
+void TestDictionaries() {
+  std::mt19937 generator(2018);
+  for (size_t iteration = 0; iteration < 500; ++iteration) {
+    const size_t alphabet_size = 1 + generator() % 5;
+    std::vector<std::string> words(1 + generator() % 30);
+    aho_corasick::AutomatonBuilder builder;
+    aho_corasick::IncrementalAutomaton incremental_automaton;
+    std::string lines;
+    for (size_t id = 0; id < words.size(); ++id) {
+      words[id] = RandomString(1 + generator() % 7, alphabet_size, &generator);
+      builder.Add(words[id], id);
+      incremental_automaton.Add(words[id], id);
+      lines += words[id] + ((id % 2 == 0) ? "\n" : "\r\n");
+    }
+    aho_corasick::AutomatonBuilder line_builder;
+    line_builder.AddLines(lines.data(), lines.size());
+
+    // The text has a character that is in no word
+    const std::string text =
+        RandomString(generator() % 300, alphabet_size + 1, &generator);
+    const auto expected = NaiveDictionaryMatches(words, text);
+
+    const auto automaton = builder.Build();
+    const auto arena_automaton = builder.BuildArena();
+    const auto dense_automaton = builder.BuildDense();
+    const auto double_array_automaton = builder.BuildDoubleArray();
+    std::ostringstream image_stream;
+    double_array_automaton->Serialize(image_stream);
+    const std::string image = image_stream.str();
+    const aho_corasick::AutomatonImage image_automaton(image.data(),
+                                                       image.size());
+
+    Expect(ScanByCharacter(automaton->Root(), text) == expected, "map");
+    Expect(ScanByCharacter(arena_automaton->Root(), text) == expected,
+           "arena");
+    Expect(ScanByCharacter(dense_automaton->Root(), text) == expected,
+           "dense");
+    Expect(ScanByCharacter(double_array_automaton->Root(), text) == expected,
+           "double array");
+    Expect(ScanByCharacter(image_automaton.Root(), text) == expected,
+           "image");
+    Expect(ScanByCharacter(line_builder.BuildArena()->Root(), text) ==
+               expected,
+           "words added as lines");
+    Expect(Sorted(FindDictionaryMatches<1>(
+               *double_array_automaton,
+               double_array_automaton->MaxStringLength(), text)) == expected,
+           "FindDictionaryMatches<1>");
+    Expect(Sorted(FindDictionaryMatches<4>(image_automaton,
+                                           image_automaton.MaxStringLength(),
+                                           text)) == expected,
+           "FindDictionaryMatches<4>");
+    Expect(ScanIncremental(incremental_automaton.Root(), text) == expected,
+           "incremental");
+  }
+}
+
+// Writes images of a dictionary to files, from a stream of words and from
+// a pattern file, and scans the mapped images, as the --write-image
+// and --image modes do
+void TestImageFile() {
+  std::mt19937 generator(2022);
+  TemporaryDirectory directory;
+  const std::string image_path = directory.File("dictionary.image");
+  std::vector<std::string> words(1000);
+  std::string dictionary;
+  for (auto &word : words) {
+    word = RandomString(1 + generator() % 8, 3, &generator);
+    dictionary += word + "\n";
+  }
+  std::istringstream dictionary_stream(dictionary);
+  WriteDictionaryImage(dictionary_stream, image_path);
+  // The last line has no line break
+  const std::string pattern_path = directory.File("dictionary.txt");
+  std::ofstream(pattern_path) << dictionary.substr(0, dictionary.size() - 1);
+  const std::string lines_image_path = directory.File("lines.image");
+  WriteDictionaryImage(MappedFile(pattern_path), lines_image_path);
+
+  const std::string text = RandomString(10000, 4, &generator);
+  const auto expected = NaiveDictionaryMatches(words, text);
+  for (const auto &path : {image_path, lines_image_path}) {
+    const MappedFile image_file(path);
+    const aho_corasick::AutomatonImage automaton(image_file.Data(),
+                                                 image_file.Size());
+    Expect(Sorted(FindDictionaryMatches<4>(automaton,
+                                           automaton.MaxStringLength(),
+                                           text)) == expected,
+           "image file " + path);
+  }
+
+  const MappedFile image_file(image_path);
+  bool rejected = false;
+  try {
+    aho_corasick::AutomatonImage(image_file.Data(), image_file.Size() - 1);
+  } catch (const std::runtime_error &) {
+    rejected = true;
+  }
+  Expect(rejected, "truncated image");
+
+  rejected = false;
+  try {
+    MappedFile(directory.File("missing.image"));
+  } catch (const std::system_error &) {
+    rejected = true;
+  }
+  Expect(rejected, "missing image file");
+}
+
+// Every image with an index out of its array, or with a suffix link
+// cycle, is rejected
+void TestCorruptedImages() {
+  typedef aho_corasick::DoubleArrayCell Cell;
+  aho_corasick::AutomatonBuilder builder;
+  for (const std::string word : {"ab", "abc", "bc", "bca", "cab"}) {
+    builder.Add(word, 0);
+  }
+  std::ostringstream image_stream;
+  builder.BuildDoubleArray()->Serialize(image_stream);
+  const std::string image = image_stream.str();
+  aho_corasick::internal::ImageHeader header;
+  std::memcpy(&header, image.data(), sizeof(header));
+  const size_t cells_offset = sizeof(header) + aho_corasick::kAlphabetSize;
+  const size_t offsets_offset =
+      cells_offset +
+      aho_corasick::internal::CellsSizeInImage(header.number_of_cells);
+
+  const auto expect_rejected = [](const std::string &corrupted_image,
+                                  const std::string &what) {
+    bool rejected = false;
+    try {
+      aho_corasick::AutomatonImage(corrupted_image.data(),
+                                   corrupted_image.size());
+    } catch (const std::runtime_error &) {
+      rejected = true;
+    }
+    Expect(rejected, "image with " + what);
+  };
+  const auto with_header =
+      [&image](const aho_corasick::internal::ImageHeader &corrupted_header) {
+        std::string corrupted_image = image;
+        std::memcpy(&corrupted_image[0], &corrupted_header,
+                    sizeof(corrupted_header));
+        return corrupted_image;
+      };
+  const auto cell = [&image, cells_offset](size_t index) {
+    Cell cell;
+    std::memcpy(&cell, &image[cells_offset + index * sizeof(Cell)],
+                sizeof(cell));
+    return cell;
+  };
+  const auto with_cell = [&image, cells_offset](size_t index,
+                                                const Cell &corrupted_cell) {
+    std::string corrupted_image = image;
+    std::memcpy(&corrupted_image[cells_offset + index * sizeof(Cell)],
+                &corrupted_cell, sizeof(corrupted_cell));
+    return corrupted_image;
+  };
+
+  auto corrupted_header = header;
+  // The size of the cells wraps around to a small number
+  corrupted_header.number_of_cells = (size_t(1) << 62) + 1;
+  expect_rejected(with_header(corrupted_header), "too many cells");
+  corrupted_header = header;
+  corrupted_header.number_of_ids = size_t(1) << 61;
+  expect_rejected(with_header(corrupted_header), "too many ids");
+  corrupted_header = header;
+  corrupted_header.number_of_classes = header.number_of_cells + 1;
+  expect_rejected(with_header(corrupted_header), "too many classes");
+
+  std::string corrupted_image = image;
+  corrupted_image[sizeof(header) + 'z'] = static_cast<char>(255);
+  expect_rejected(corrupted_image, "a byte class out of range");
+
+  // Cell 1 is a child of the root
+  Cell corrupted_cell = cell(1);
+  corrupted_cell.base = header.number_of_cells;
+  expect_rejected(with_cell(1, corrupted_cell), "a base out of range");
+  corrupted_cell = cell(1);
+  corrupted_cell.suffix_link = header.number_of_cells;
+  expect_rejected(with_cell(1, corrupted_cell), "a suffix link out of range");
+  corrupted_cell = cell(1);
+  corrupted_cell.suffix_link = 1;
+  expect_rejected(with_cell(1, corrupted_cell), "a suffix link cycle");
+
+  corrupted_image = image;
+  corrupted_image[offsets_offset +
+                  header.number_of_cells * sizeof(size_t)] += 1;
+  expect_rejected(corrupted_image, "offsets past the ids");
+}
+
+// Streams texts of several blocks from mapped files. The text is the first
+// word of the file, as in the --stream mode
+void TestStreamFile() {
+  std::mt19937 generator(2023);
+  TemporaryDirectory directory;
+  for (size_t iteration = 0; iteration < 20; ++iteration) {
+    const std::string pattern =
+        RandomPattern(1 + generator() % 50, 2, 2 + generator() % 5, &generator);
+    const std::string text = RandomString(
+        (iteration == 0) ? 0 : generator() % (3 * kStreamBlockSize), 2,
+        &generator);
+    // Whatever follows the first word is not scanned
+    const std::string rest =
+        text.empty() ? "" : "\n" + RandomString(100, 2, &generator);
+    const std::string path = directory.File(std::to_string(iteration));
+    std::ofstream(path) << std::string(generator() % 3, '\n') << text << rest;
+
+    const MappedFile file(path);
+    MappedBlockSource source(file);
+    std::ostringstream output_stream;
+    const size_t number_of_matches =
+        StreamFuzzyMatches(pattern, kWildcard, &source, output_stream);
+    const std::vector<size_t> expected = NaiveFuzzyMatches(pattern, text);
+    Expect(number_of_matches == expected.size() &&
+               output_stream.str() == Joined(expected),
+           "StreamFuzzyMatches on a mapped file, pattern " + pattern);
+  }
+}
+
+// A cursor scans the strings added before it was created,
+// whatever is added later
+void TestIncrementalCursors() {
+  std::mt19937 generator(2024);
+  const std::string text = RandomString(3000, 3, &generator);
+  aho_corasick::IncrementalAutomaton automaton;
+  std::vector<std::string> words;
+  std::vector<aho_corasick::IncrementalAutomaton::Cursor> cursors;
+  std::vector<std::vector<std::pair<size_t, size_t>>> expected;
+  for (size_t id = 0; id < 100; ++id) {
+    words.push_back(RandomString(1 + generator() % 6, 3, &generator));
+    automaton.Add(words.back(), id);
+    if (id % 7 == 0) {
+      cursors.push_back(automaton.Root());
+      expected.push_back(NaiveDictionaryMatches(words, text));
+    }
+  }
+  for (size_t index = 0; index < cursors.size(); ++index) {
+    Expect(ScanIncremental(cursors[index], text) == expected[index],
+           "incremental cursor " + std::to_string(index));
+  }
+}
+
+// Readers take cursors while a writer adds strings. A cursor scans
+// the strings added before some moment between the last addition
+// the reader saw finished and the first one it did not
+void TestConcurrentIncremental() {
+  constexpr size_t kNumberOfWords = 300;
+  std::mt19937 generator(2026);
+  const std::string text = RandomString(500, 3, &generator);
+  std::vector<std::string> words;
+  for (size_t id = 0; id < kNumberOfWords; ++id) {
+    words.push_back(RandomString(1 + generator() % 5, 3, &generator));
+  }
+  const auto all_matches = NaiveDictionaryMatches(words, text);
+  const auto matches_of_first = [&all_matches](size_t number_of_words) {
+    std::vector<std::pair<size_t, size_t>> matches;
+    for (const auto &match : all_matches) {
+      if (match.second < number_of_words) {
+        matches.push_back(match);
+      }
+    }
+    return matches;
+  };
+
+  aho_corasick::IncrementalAutomaton automaton;
+  std::atomic<size_t> number_of_added(0);
+  std::atomic<bool> consistent(true);
+  std::vector<std::thread> readers;
+  for (size_t reader = 0; reader < 2; ++reader) {
+    readers.emplace_back([&] {
+      while (number_of_added < kNumberOfWords) {
+        const size_t least_number = number_of_added;
+        const auto cursor = automaton.Root();
+        const size_t greatest_number =
+            std::min(number_of_added + 1, kNumberOfWords);
+        const auto matches = ScanIncremental(cursor, text);
+        bool found = false;
+        for (size_t number = least_number; number <= greatest_number;
+             ++number) {
+          found = found || matches == matches_of_first(number);
+        }
+        if (!found) {
+          consistent = false;
+        }
+      }
+    });
+  }
+  for (size_t id = 0; id < kNumberOfWords; ++id) {
+    automaton.Add(words[id], id);
+    ++number_of_added;
+  }
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  Expect(consistent, "cursors taken during additions");
+}
+
+// Some levels of the trie have more than three times kMinPartLength
+// states, so their links are built by three threads
+void TestParallelBuild() {
+  std::mt19937 generator(2019);
+  aho_corasick::AutomatonBuilder serial_builder;
+  aho_corasick::AutomatonBuilder parallel_builder;
+  serial_builder.SetNumberOfThreads(1);
+  parallel_builder.SetNumberOfThreads(3);
+  std::vector<std::unordered_set<std::string>> levels(13);
+  for (size_t id = 0; id < 60000; ++id) {
+    const std::string word = RandomString(6 + generator() % 7, 4, &generator);
+    serial_builder.Add(word, id);
+    parallel_builder.Add(word, id);
+    for (size_t depth = 0; depth <= word.size(); ++depth) {
+      levels[depth].insert(word.substr(0, depth));
+    }
+  }
+  size_t max_level_size = 0;
+  for (const auto &level : levels) {
+    max_level_size = std::max(max_level_size, level.size());
+  }
+  Expect(max_level_size > 3 * (1 << 12), "size of the largest level");
+
+  const std::string text = RandomString(1 << 12, 5, &generator);
+  Expect(ScanByCharacter(serial_builder.BuildArena()->Root(), text) ==
+             ScanByCharacter(parallel_builder.BuildArena()->Root(), text),
+         "parallel build");
+  Expect(ScanByCharacter(serial_builder.BuildDoubleArray()->Root(), text) ==
+             ScanByCharacter(parallel_builder.BuildDoubleArray()->Root(),
+                             text),
+         "parallel double array build");
+}
+
+// Splits the output of a corpus scan into the results of the files,
+// three lines each, and sorts them, as files may finish in any order
+std::vector<std::string> CorpusResults(const std::string &output) {
+  std::istringstream output_stream(output);
+  std::vector<std::string> results;
+  std::string path, count, positions;
+  while (std::getline(output_stream, path) &&
+         std::getline(output_stream, count) &&
+         std::getline(output_stream, positions)) {
+    results.push_back(path + "\n" + count + "\n" + positions + "\n");
+  }
+  std::sort(results.begin(), results.end());
+  return results;
+}
+
+// Scans files of a temporary directory, including an empty one, mixed with
+// paths that do not exist. The missing files are reported as failures and
+// every other file gets its own result
+void TestCorpus() {
+  std::mt19937 generator(2025);
+  TemporaryDirectory directory;
+  for (size_t iteration = 0; iteration < 10; ++iteration) {
+    const std::string pattern =
+        RandomPattern(1 + generator() % 40, 2, 2 + generator() % 5, &generator);
+    std::vector<std::string> paths;
+    std::vector<std::string> expected;
+    for (size_t file = 0; file < 30; ++file) {
+      const std::string name =
+          std::to_string(iteration) + "." + std::to_string(file);
+      paths.push_back(directory.File(name));
+      if (file % 10 == 3) {
+        continue;
+      }
+      const std::string text =
+          RandomString((file == 0) ? 0 : generator() % 5000, 2, &generator);
+      std::ofstream(paths.back()) << text;
+      const auto occurrences = NaiveFuzzyMatches(pattern, text);
+      expected.push_back(paths.back() + "\n" +
+                         std::to_string(occurrences.size()) + "\n" +
+                         Joined(occurrences) + "\n");
+    }
+    std::sort(expected.begin(), expected.end());
+
+    for (const size_t number_of_threads : {1, 3}) {
+      // The scan reports every missing file to std::cerr
+      std::streambuf *const error_buffer = std::cerr.rdbuf(nullptr);
+      std::ostringstream output_stream;
+      const size_t number_of_failures =
+          (number_of_threads == 1) ?
+              ScanCorpus(pattern, kWildcard, paths, output_stream,
+                         number_of_threads) :
+              ScanCorpusWith<NttWildcardMatcher>(pattern, kWildcard, paths,
+                                                 number_of_threads,
+                                                 output_stream);
+      std::cerr.rdbuf(error_buffer);
+      Expect(number_of_failures == 3 &&
+                 CorpusResults(output_stream.str()) == expected,
+             "ScanCorpus on pattern " + pattern);
+    }
+  }
+}
+
+// Words over arbitrary bytes, up to all 256 of them,
+// so that every byte may need its own class
+void TestByteClasses() {
+  std::mt19937 generator(2021);
+  for (size_t iteration = 0; iteration < 100; ++iteration) {
+    std::string alphabet;
+    for (size_t byte = 0; byte < 256; ++byte) {
+      if (byte == 0 || iteration % 10 == 0 || generator() % 32 == 0) {
+        alphabet.push_back(static_cast<char>(byte));
+      }
+    }
+    std::vector<std::string> words(1 + generator() % 300);
+    aho_corasick::AutomatonBuilder builder;
+    for (size_t id = 0; id < words.size(); ++id) {
+      for (size_t length = 1 + generator() % 4; length > 0; --length) {
+        words[id].push_back(alphabet[generator() % alphabet.size()]);
+      }
+      builder.Add(words[id], id);
+    }
+    std::string text;
+    for (size_t length = generator() % 2000; length > 0; --length) {
+      text.push_back(static_cast<char>(generator()));
+    }
+    text += words[0];
+    const auto expected = NaiveDictionaryMatches(words, text);
+
+    Expect(ScanByCharacter(builder.BuildDense()->Root(), text) == expected,
+           "dense over " + std::to_string(alphabet.size()) + " bytes");
+    Expect(ScanByCharacter(builder.BuildDoubleArray()->Root(), text) ==
+               expected,
+           "double array over " + std::to_string(alphabet.size()) + " bytes");
+  }
+}
+
+}  // namespace
+
+int main() {
+  TestFuzzyMatches();
+  TestManyWords();
+  TestLongNttPattern();
+  TestMultiplePatterns();
+  TestDictionaries();
+  TestIncrementalCursors();
+  TestConcurrentIncremental();
+  TestParallelBuild();
+  TestByteClasses();
+  TestImageFile();
+  TestCorruptedImages();
+  TestStreamFile();
+  TestCorpus();
+  std::cout << "all tests passed" << std::endl;
+  return 0;
+}
@@ -86,19 +86,13 @@ AutomatonNode *GetTrieTransition(AutomatonNode *node, char character) {
     node->automaton_transitions_cache[character] : nullptr;
 }
 
-// Provides constant amortized runtime
-AutomatonNode *GetAutomatonTransition(AutomatonNode *node, AutomatonNode *root,
-                                      char character) {
-  if (node->automaton_transitions_cache[character]) {
-      return node->automaton_transitions_cache[character];
-  }
-  while (node != root && !GetTrieTransition(node, character)) {
-    node = node->suffix_link;
-  }
-
-  auto transition = GetTrieTransition(node, character);
-  node->automaton_transitions_cache[character] = transition ? transition : node;
-  return node->automaton_transitions_cache[character];
+// Transitions are completed by AutomatonBuilder, so the automaton is never
+// modified here. Characters which do not occur in the patterns lead to the root
+AutomatonNode *GetAutomatonTransition(const AutomatonNode *node,
+                                      AutomatonNode *root, char character) {
+  const auto transition = node->automaton_transitions_cache.find(character);
+  return (transition != node->automaton_transitions_cache.end()) ?
+    transition->second : root;
 }
 
 namespace internal {
@@ -170,6 +164,20 @@ class TerminalLinkCalculator
   AutomatonNode *root_;
 };
 
+// Collects nodes in breadth-first order
+class NodeCollector
+    : public traverses::BfsVisitor<AutomatonNode *, AutomatonGraph::Edge> {
+ public:
+  explicit NodeCollector(std::vector<AutomatonNode *> *nodes) : nodes_(nodes) {}
+
+  void ExamineVertex(AutomatonNode *node) override {
+    nodes_->push_back(node);
+  }
+
+ private:
+  std::vector<AutomatonNode *> *nodes_;
+};
+
 }  // namespace internal
 
 
@@ -240,6 +248,7 @@ class AutomatonBuilder {
     BuildTrie(words_, automaton.get());
     BuildSuffixLinks(automaton.get());
     BuildTerminalLinks(automaton.get());
+    CompleteTransitions(automaton.get());
     return automaton;
   }
 
@@ -281,6 +290,38 @@ class AutomatonBuilder {
       terminalLinkCalculator);
   }
 
+  // Nodes are collected before the completion, because afterwards
+  // automaton_transitions_cache holds more than the trie edges.
+  // Suffix link of a node precedes it in breadth-first order,
+  // so its transitions are already completed
+  void CompleteTransitions(Automaton *automaton) const {
+    std::string alphabet;
+    for (const auto& word : words_) {
+      for (char symbol : word) {
+        if (alphabet.find(symbol) == std::string::npos) {
+          alphabet.push_back(symbol);
+        }
+      }
+    }
+
+    std::vector<AutomatonNode *> nodes;
+    internal::NodeCollector nodeCollector(&nodes);
+    traverses::BreadthFirstSearch(&automaton->root_,
+      internal::AutomatonGraph(),
+      nodeCollector);
+
+    AutomatonNode* root = &automaton->root_;
+    for (AutomatonNode* node : nodes) {
+      for (char symbol : alphabet) {
+        AutomatonNode*& transition = node->automaton_transitions_cache[symbol];
+        if (!transition) {
+          transition = (node == root) ? root :
+            node->suffix_link->automaton_transitions_cache[symbol];
+        }
+      }
+    }
+  }
+
   std::vector<std::string> words_;
 };
 